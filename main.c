@@ -5,22 +5,52 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <locale.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#include <wchar.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define JEDITOR_X86 1
+#endif
 
 /*==== DEFINES ====*/ // 163
 
 #define JEDITOR_VERSION "0.0.1"
 #define JEDITOR_TAB_STOP 8
 #define JEDITOR_QUIT_TIMES 3
+#define JEDITOR_HL_BUDGET 2048 // Rows highlighted per idle slice
+#define JEDITOR_MAX_THREADS 8
+#define JEDITOR_INDEX_MIN_CHUNK (1 << 20) // Bytes of file per indexing thread
+#define JEDITOR_SEARCH_MIN_ROWS (1 << 16) // Rows per search thread
+#define JEDITOR_SAVE_BATCH 512 // Rows per writev when saving
+#define JEDITOR_JOURNAL_BATCH (8 << 10) // Buffered journal bytes that force a write
+#define JEDITOR_FOLLOW_READ (64 << 10) // Bytes read at a time from a followed file or stdin
+#define JEDITOR_PIPE_PENDING (4 << 20) // Bytes read from stdin ahead of the rows
+#define JEDITOR_INPUT_CHUNK (16 << 10) // Bytes of keys read at once, handled before one redraw
+#define JEDITOR_ESC_WAIT 100 // Milliseconds for the rest of an escape sequence to arrive
+#define JEDITOR_IDLE_WAIT 100 // Milliseconds without input before journals are synced
+#define JEDITOR_PASTE_WAIT 1000 // Milliseconds a paste may stall before it is taken as ended
+#define JEDITOR_FRAME_MS 16 // Shortest time between frames written to the terminal
+#define JEDITOR_ROW_MARK 256 // Bytes of a row between the columns it remembers
+#define JEDITOR_LONG_ROW (64 << 10) // Bytes from which a row is only rendered around what is on screen
+#define JEDITOR_ROW_CHUNK (1 << 10) // Bytes of a long row between points the highlighter can restart from
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -34,7 +64,9 @@ enum editorKey {
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    PASTE_START, // Bracketed paste, CSI 200~
+    PASTE_END    // CSI 201~
 };
 
 enum editorHighlight {
@@ -48,11 +80,25 @@ enum editorHighlight {
     HL_MATCH
 };
 
+#define CELL_INVERSE (1<<7) // Screen cell attribute on top of its editorHighlight
+
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
 /*==== DATA ====*/
 
+struct keywordEntry {
+    const char* word;
+    unsigned char len;
+    unsigned char hl;
+};
+
+struct keywordTable {
+    struct keywordEntry* entries; // Sorted by first character, then length
+    int bucket[257];              // entries[bucket[c], bucket[c + 1]) start with c
+    int maxLen;
+};
+
 struct EditorSyntax{
     char* filetype;
     char** filematch;
@@ -61,32 +107,206 @@ struct EditorSyntax{
     char* multilineCommentStart;
     char* multilineCommentEnd;
     int flags;
+    struct keywordTable* compiled; // keywords, built by EditorCompileSyntaxDB
+};
+
+// Where the highlighter is partway through a row
+struct hlState {
+    unsigned char inComment;
+    unsigned char inString;  // The quote that opened it
+    unsigned char prevSep;
+    unsigned char prevHL;    // Of the byte before
+    unsigned char lineComment;
 };
 
+// A point of a long row the highlighter stopped at, with what it takes to
+// start again from there
+struct rowChunk {
+    int at;
+    int col;
+    struct hlState state;
+    unsigned char tabs; // Any in chars from here to the next chunk
+};
+
+// Where a character of a row starts in chars, in render and on screen
+struct rowMark {
+    int chars;
+    int render;
+    int col;
+};
+
+// What a row needs once it is drawn or edited. Its size, text and comment
+// state live in the row store.
 typedef struct eRow{
-    int idx;
-    int size;
-    int rndrSize;
     char* chars;
     char* render;
     unsigned char* highlight;
-    int hlOpenComment;
+    int rndrSize;
+    int charsCap;
+    int rndrCap;  // Of both render and highlight
+    int tabs;     // Tabs in chars, rows without any render as a copy of chars
+    int ascii;    // Every byte below 0x80, so each one is a column of render
+    struct rowMark* marks; // The first character from every JEDITOR_ROW_MARK bytes of chars, see EditorRowMarkAt
+    int numMarks;
+    int marksCap; // In bytes
+    int chunked;  // Longer than JEDITOR_LONG_ROW, render and highlight only hold chars from winAt to winEnd
+    struct rowChunk* chunks;
+    int numChunks;
+    int chunksCap; // In bytes
+    int chunkOpen; // Comment state at the end of the row when it was last highlighted up to there
+    int winAt;
+    int winEnd;    // -1 once the window is out of date
+    int winCol;    // Columns the window starts and ends at
+    int winColEnd;
 } eRow;
 
-struct EditorConfig {
+// Rows as parallel arrays, so scans over every row only touch the field they
+// need. All of them share one gap, see EditorRowSlot.
+struct rowStore {
+    int* size;
+    const char** text;    // In the file mapping or load arena, or data->chars once materialized
+    signed char* hlState; // Comment left open at the end of the row, -1 if unknown
+    eRow** data;          // NULL until materialized
+    int cap;
+    int gap;
+};
+
+struct searchMatch {
+    int row;
+    int col; // Byte offset into the row's chars
+    int len;
+};
+
+struct searchIndex {
+    char* query;
+    int queryLen;
+    int regex;
+    struct regex* re;
+    int numRows; // Row count when the matches were collected
+    struct dfa* dfas;  // Forward and reverse DFA of each scan worker, kept between scans
+    char* dfaPattern;  // The pattern their states were built for
+    struct searchMatch* matches; // Every match of query, sorted
+    int count;
+    int cap;
+    int current; // Match the cursor is on, -1 for none
+};
+
+struct undoLog {
+    struct undoBlock* head; // Oldest block
+    struct undoBlock* tail;
+    struct undoBlock* block; // Position: records before off in block are applied
+    size_t off;
+    size_t bytes;
+    int sealed;
+};
+
+#define ROW_MEM_CLASSES 13 // Power of two block sizes from ROW_MEM_MIN to 64K
+
+struct rowMemBlock {
+    struct rowMemBlock* prev;
+    struct rowMemBlock* next;
+};
+
+struct rowMem {
+    void* freeList[ROW_MEM_CLASSES];
+    char* slab;   // Where the next block is carved from
+    size_t slabLeft;
+    char* arena;  // Where the next loaded row is copied to
+    size_t arenaLeft;
+    struct rowMemBlock* pages; // Slab pages and arena blocks
+    struct rowMemBlock* large; // Blocks above the largest class
+    size_t slabReserved;
+    size_t slabInUse;
+    size_t arenaReserved;
+    size_t arenaUsed;
+    size_t largeInUse;
+};
+
+struct journal {
+    int fd;         // -1 until the first edit after opening or saving
+    char* path;
+    char* buf;      // Records not written yet
+    size_t len;
+    size_t cap;
+    time_t oldest;  // When the first unwritten record was added
+    int unsynced;   // Written but not fdatasync'd
+    int replaying;
+    int failed;
+    int shared;     // Another buffer on the same file owns its journal
+    int keep;       // The last save failed, so it outlives the buffer
+    int64_t baseSize; // The file the journal applies to
+    int64_t baseSec;
+    int64_t baseNsec;
+};
+
+struct screenCell {
+    char c[4];         // One UTF-8 character
+    unsigned char len; // Bytes of c, 0 for the right half of a wide character
+    unsigned char attr;
+};
+
+struct follow {
+    int fd;       // -1 when not following
+    int wd;       // inotify watch
+    off_t offset; // Bytes of the file already in rows
+    int partial;  // The last row is still waiting for its '\n'
+    int maxRows;  // Rows kept from the end, 0 for no limit
+    int piped;    // Still being read from stdin
+};
+
+// An open file and everything about it that is not shared between buffers
+struct editorBuffer {
     int curX, curY;
     int rndrX; // For eRow render (tabs and such)
-    int terminalRows;
-    int terminalCols;
     int rowOff;
     int colOff;
     int numRows;
-    eRow* row;
+    struct rowStore rows;
+    struct sharedMap* map; // Backing store for rows that were never materialized
+    struct rowMem mem;
+    int hlFrontier; // Every row above this has an up to date comment state
     int dirty;
     char* filename;
+    struct EditorSyntax* syntax;
+    struct searchIndex search;
+    struct undoLog undo;
+    struct journal journal;
+    struct follow follow;
+};
+
+// How the editor talks to the terminal: ttyTerminal for a real one,
+// memoryTerminal for scripted keys and captured output
+struct terminal {
+    void (*enableRawMode)();
+    void (*disableRawMode)();
+    int (*read)(char* buf, size_t len); // Bytes read without blocking, -1 on error
+    int (*fd)();          // What to poll for input, -1 if it never has to be waited for
+    int (*write)(const char* buf, size_t len);
+    int (*getSize)(int* rows, int* cols);
+};
+
+struct EditorConfig {
+    const struct terminal* term;
+    struct editorBuffer* buf; // The buffer on screen
+    struct editorBuffer** buffers;
+    int numBuffers;
+    int inotifyFd; // Shared by every followed file, -1 until one is
+    int ttyFd;     // Where keys are read from, /dev/tty when stdin is piped data
+    int recordFd;  // Keys read are copied here by -r, -1 otherwise
+    int wakeFd[2]; // Background threads write to [1] so the input loop wakes up
+    char input[JEDITOR_INPUT_CHUNK]; // Read from the terminal, not made into keys yet
+    int inputLen;
+    int inputPos;
+    int terminalRows;
+    int terminalCols;
     char statusMsg[80];
     time_t statusMsgTime;
-    struct EditorSyntax* syntax;
+    struct screenCell* front; // What the terminal shows
+    struct screenCell* back;  // The frame being drawn
+    int screenValid;
+    int screenRowOff;
+    struct editorBuffer* screenBuf; // Whose rows the terminal shows, scrolling only applies within one
+    int screenCurY, screenCurX;
     struct termios originalTermios;
 };
 
@@ -108,7 +328,8 @@ struct EditorSyntax HLDB[] = {
         C_HL_Extentions,
         C_HL_Keywords,
         "//", "/*", "*/",
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        NULL
     },
 };
 
@@ -116,28 +337,54 @@ struct EditorSyntax HLDB[] = {
 
 /*==== PROTOTYPES ====*/
 
+eRow* EditorRowAt(int at);
+int EditorRowSize(int at);
+const char* EditorRowText(int at);
+signed char* EditorRowHlState(int at);
+eRow* EditorRowMaterialize(int at);
+void EditorLongRowScan(int at, int k);
+int EditorSyntaxPending();
+int EditorSyntaxIdle();
+int EditorSaveReap(int wait);
+int WriteAll(int fd, const char* buf, size_t len);
+void JournalAppend(int type, int row, int col, const char* text, int len);
+void JournalCommit(struct journal* j, int sync);
+void SharedMapRelease(struct sharedMap* sm);
+int EditorFollowPoll();
+int EditorPipePoll();
+void EditorPipeAbandon();
 void EditorSetStatusMessage(const char* fmt, ...);
 void EditorRefreshScreen();
+void EditorRenderStop();
 char* EditorPrompt(char* prompt, void(*callback)(char*, int));
 
 /*==== TERMINAL ====*/
 
 void Die(const char* msg){
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
+    EditorRenderStop();
+    if(E.term) E.term->write("\x1b[2J\x1b[H", 7);
 
     perror(msg);
     exit(1);
 }
 
 void DisableRawMode(){
-    if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.originalTermios) == -1){
+    E.term->disableRawMode();
+}
+
+void EnableRawMode(){
+    E.term->enableRawMode();
+}
+
+void TtyDisableRawMode(){
+    WriteAll(STDOUT_FILENO, "\x1b[?2004l", 8); // Bracketed paste off
+    if(tcsetattr(E.ttyFd, TCSAFLUSH, &E.originalTermios) == -1){
         Die("tcsetattr");
     }
 }
 
-void EnableRawMode(){
-    if(tcgetattr(STDIN_FILENO, &E.originalTermios) == -1){
+void TtyEnableRawMode(){
+    if(tcgetattr(E.ttyFd, &E.originalTermios) == -1){
         Die("tcgetattr");
     }
     atexit(DisableRawMode);
@@ -147,30 +394,263 @@ void EnableRawMode(){
     raw.c_oflag &= ~(OPOST); // Disable output processing to output raw data
     raw.c_cflag &= ~(CS8); // Control flags configure character size (CS8 = 8 bits per byte)
     raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG); // Local flags to disable terminal features ie. echo & canonical
-    raw.c_cc[VMIN] = 0; // The minimum number of bytes of input before read() can return
-    raw.c_cc[VTIME] = 1; // The maximum amount of time before read() returns (1 = 100 milliseconds)
+    raw.c_cc[VMIN] = 0; // read() returns right away, EditorWaitInput polls instead
+    raw.c_cc[VTIME] = 0;
 
-    if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1){
+    if(tcsetattr(E.ttyFd, TCSAFLUSH, &raw) == -1){
         Die("tcsetattr");
     }
+
+    WriteAll(STDOUT_FILENO, "\x1b[?2004h", 8); // Pastes arrive wrapped in PASTE_START and PASTE_END
 }
 
-int EditorReadKey(){
-    int nread;
-    char c;
-    while((nread = read(STDIN_FILENO, &c, 1)) != 1){
-        if(nread == -1 && errno != EAGAIN){
-            Die("read");
+int TtyRead(char* buf, size_t len){
+    int nread = read(E.ttyFd, buf, len);
+    if(nread == -1) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+
+    if(nread > 0 && E.recordFd != -1 && WriteAll(E.recordFd, buf, nread) == -1){
+        close(E.recordFd);
+        E.recordFd = -1;
+        EditorSetStatusMessage("Recording stopped: %s", strerror(errno));
+    }
+
+    return nread;
+}
+
+int TtyFd(){
+    return E.ttyFd;
+}
+
+int TtyWrite(const char* buf, size_t len){
+    return WriteAll(STDOUT_FILENO, buf, len);
+}
+
+int GetCursorPosition(int* rows, int* cols){
+    char buf[32];
+    unsigned int i = 0;
+
+    if(write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
+
+    while(i < sizeof(buf) - 1){
+        struct pollfd pfd = {E.ttyFd, POLLIN, 0};
+        if(poll(&pfd, 1, 1000) <= 0 || read(E.ttyFd, &buf[i], 1) != 1) break;
+        if(buf[i] == 'R') break;
+        i++;
+    }
+
+    buf[i] = '\0';
+
+    if(buf[0] != '\x1b' || buf[1] != '[') return -1;
+    if(sscanf(&buf[2], "%d;%d", rows, cols) != 2) return -1;
+
+    return 0;
+}
+
+int TtyGetSize(int* rows, int* cols){
+    struct winsize ws;
+
+    if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0){
+        if(write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) return -1; // If we cant move cursor to bottom right return (fallback for ioctl)
+        return GetCursorPosition(rows, cols);
+    }
+    else {
+        *cols = ws.ws_col;
+        *rows = ws.ws_row;
+        return 0;
+    }
+}
+
+const struct terminal ttyTerminal = {
+    TtyEnableRawMode, TtyDisableRawMode, TtyRead, TtyFd, TtyWrite, TtyGetSize
+};
+
+// Keys come from a script given to MemTermFeed and everything written is
+// counted, and kept while capture is set. Running out of keys is a read error,
+// so a script that stops inside a prompt ends the run instead of hanging it.
+struct memTerm {
+    const char* input;
+    size_t inputLen;
+    size_t inputPos;
+    int rows;
+    int cols;
+    int capture;
+    char* output;
+    size_t outputLen;
+    size_t outputCap;
+    size_t written;
+    int frames; // One write per refreshed screen
+};
+
+struct memTerm memTerm;
+
+void MemTermFeed(const char* keys, size_t len){
+    memTerm.input = keys;
+    memTerm.inputLen = len;
+    memTerm.inputPos = 0;
+}
+
+int MemTermPending(){
+    return memTerm.inputPos < memTerm.inputLen;
+}
+
+void MemRawMode(){
+}
+
+int MemRead(char* buf, size_t len){
+    if(!MemTermPending()){
+        errno = ENODATA;
+        return -1;
+    }
+
+    if(len > memTerm.inputLen - memTerm.inputPos) len = memTerm.inputLen - memTerm.inputPos;
+    memcpy(buf, memTerm.input + memTerm.inputPos, len);
+    memTerm.inputPos += len;
+    return len;
+}
+
+int MemFd(){
+    return -1;
+}
+
+int MemWrite(const char* buf, size_t len){
+    memTerm.written += len;
+    memTerm.frames++;
+    if(!memTerm.capture) return 0;
+
+    if(memTerm.outputLen + len > memTerm.outputCap){
+        while(memTerm.outputLen + len > memTerm.outputCap) memTerm.outputCap = memTerm.outputCap ? memTerm.outputCap * 2 : 4096;
+        memTerm.output = realloc(memTerm.output, memTerm.outputCap);
+        if(memTerm.output == NULL) Die("realloc");
+    }
+
+    memcpy(memTerm.output + memTerm.outputLen, buf, len);
+    memTerm.outputLen += len;
+    return 0;
+}
+
+int MemGetSize(int* rows, int* cols){
+    *rows = memTerm.rows;
+    *cols = memTerm.cols;
+    return 0;
+}
+
+const struct terminal memoryTerminal = {
+    MemRawMode, MemRawMode, MemRead, MemFd, MemWrite, MemGetSize
+};
+
+/*==== EVENT LOOP ====*/
+
+// Everything the editor waits on is polled together: the terminal, followed
+// files (inotify) and the wake pipe the save and stdin threads write to. Keys
+// are read a chunk at a time and the main loop handles every buffered key
+// before drawing once. With nothing to do the poll sleeps without a timeout.
+
+long long EditorMs(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+void EditorWake(){
+    char c = 1;
+    if(write(E.wakeFd[1], &c, 1) == -1 && errno != EAGAIN){} // A full pipe wakes the loop all the same
+}
+
+int EditorInputPending(){
+    return E.inputPos < E.inputLen;
+}
+
+int EditorJournalsPending(){
+    for(int b = 0; b < E.numBuffers; ++b){
+        if(E.buffers[b]->journal.len || E.buffers[b]->journal.unsynced) return 1;
+    }
+    return 0;
+}
+
+// Handles whatever woke the loop besides keys, redrawing if the screen changed
+void EditorHandleEvents(){
+    char drain[64];
+    while(read(E.wakeFd[0], drain, sizeof(drain)) > 0);
+
+    int redraw = EditorSaveReap(0);
+    if(EditorFollowPoll()) redraw = 1;
+    if(EditorPipePoll()) redraw = 1;
+
+    if(redraw) EditorRefreshScreen();
+}
+
+// Reads more into E.input after what is still unread, waiting at most timeout
+// milliseconds (-1 for as long as it takes). Background work is done meanwhile.
+// Returns whether keys arrived.
+int EditorWaitInput(int timeout){
+    long long deadline = timeout < 0 ? -1 : EditorMs() + timeout;
+
+    int kept = E.inputLen - E.inputPos;
+    memmove(E.input, E.input + E.inputPos, kept);
+    E.inputLen = kept;
+    E.inputPos = 0;
+
+    while(1){
+        int nread = E.term->read(E.input + E.inputLen, sizeof(E.input) - E.inputLen);
+        if(nread == -1) Die("read");
+        if(nread > 0){
+            E.inputLen += nread;
+            return 1;
+        }
+
+        int wait = -1;
+        if(deadline >= 0){
+            wait = deadline - EditorMs();
+            if(wait <= 0) return 0;
+        }
+
+        int journals = EditorJournalsPending();
+        if(journals && (wait < 0 || wait > JEDITOR_IDLE_WAIT)) wait = JEDITOR_IDLE_WAIT;
+        if(EditorSyntaxPending()) wait = 0; // Highlight a slice, then look for keys again
+
+        struct pollfd fds[3];
+        int count = 0;
+        if(E.term->fd() != -1) fds[count++] = (struct pollfd){E.term->fd(), POLLIN, 0};
+        fds[count++] = (struct pollfd){E.wakeFd[0], POLLIN, 0};
+        if(E.inotifyFd != -1) fds[count++] = (struct pollfd){E.inotifyFd, POLLIN, 0};
+
+        int ready = poll(fds, count, wait);
+        if(ready == -1 && errno != EINTR) Die("poll");
+
+        if(ready > 0){
+            EditorHandleEvents();
+        }
+        else if(ready == 0){
+            if(EditorSyntaxPending()){
+                if(EditorSyntaxIdle()) EditorRefreshScreen();
+            }
+            else if(journals){ // Nothing typed for a moment
+                for(int b = 0; b < E.numBuffers; ++b) JournalCommit(&E.buffers[b]->journal, 1);
+            }
         }
     }
+}
+
+// The next input byte, or -1 if none came within timeout milliseconds
+int EditorReadByte(int timeout){
+    if(!EditorInputPending() && !EditorWaitInput(timeout)) return -1;
+    return (unsigned char)E.input[E.inputPos++];
+}
+
+int EditorReadKey(){
+    int c = EditorReadByte(-1);
 
     if (c == '\x1b') {
         char seq[3];
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+        int b;
+        if ((b = EditorReadByte(JEDITOR_ESC_WAIT)) == -1) return '\x1b';
+        seq[0] = b;
+        if ((b = EditorReadByte(JEDITOR_ESC_WAIT)) == -1) return '\x1b';
+        seq[1] = b;
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+                if ((b = EditorReadByte(JEDITOR_ESC_WAIT)) == -1) return '\x1b';
+                seq[2] = b;
                 if (seq[2] == '~') {
                     switch (seq[1]) {
                     case '1': return HOME_KEY;
@@ -182,6 +662,13 @@ int EditorReadKey(){
                     case '8': return END_KEY;
                     }
                 }
+                else if (seq[1] == '2' && seq[2] == '0') { // CSI 200~ or 201~
+                    int last = EditorReadByte(JEDITOR_ESC_WAIT);
+                    if (last != '0' && last != '1') return '\x1b'; // CSI 20~ is F9, and ends at its '~'
+                    if (EditorReadByte(JEDITOR_ESC_WAIT) != '~') return '\x1b';
+                    if (last == '0') return PASTE_START;
+                    if (last == '1') return PASTE_END;
+                }
             } else {
                 switch (seq[1]) {
                 case 'A': return ARROW_UP;
@@ -204,83 +691,149 @@ int EditorReadKey(){
     }
 }
 
-int GetCursorPosition(int* rows, int* cols){
-    char buf[32];
-    unsigned int i = 0;
+/*==== SYNTAX HIGHLIGHTING ====*/
 
-    if(write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
+int IsSeparator(int c){
+    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
 
-    while(i < sizeof(buf) - 1){
-        if(read(STDIN_FILENO, &buf[i], 1) != 1) break;
-        if(buf[i] == 'R') break;
-        i++;
+int KeywordEntryCompare(const void* a, const void* b){
+    const struct keywordEntry* ka = a;
+    const struct keywordEntry* kb = b;
+
+    if(ka->word[0] != kb->word[0]) return (unsigned char)ka->word[0] - (unsigned char)kb->word[0];
+    if(ka->len != kb->len) return ka->len - kb->len;
+    return strncmp(ka->word, kb->word, ka->len);
+}
+
+// Turns a keyword list (entries ending in | are keyword2) into a table keyed by
+// first character and length. Keywords must not contain separators.
+struct keywordTable* KeywordTableCompile(char** keywords){
+    int count = 0;
+    while(keywords[count]) count++;
+
+    struct keywordTable* kt = calloc(1, sizeof(struct keywordTable));
+    if(kt == NULL) Die("calloc");
+
+    kt->entries = malloc(sizeof(struct keywordEntry) * (count ? count : 1));
+    if(kt->entries == NULL) Die("malloc");
+
+    int n = 0;
+    for(int j = 0; j < count; ++j){
+        int len = strlen(keywords[j]);
+        int kw2 = keywords[j][len - 1] == '|';
+        if(kw2) len--;
+        if(len <= 0 || len > 255) continue;
+
+        kt->entries[n].word = keywords[j];
+        kt->entries[n].len = len;
+        kt->entries[n].hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+        if(len > kt->maxLen) kt->maxLen = len;
+        n++;
     }
 
-    buf[i] = '\0';
+    qsort(kt->entries, n, sizeof(struct keywordEntry), KeywordEntryCompare);
 
-    if(buf[0] != '\x1b' || buf[1] != '[') return -1;
-    if(sscanf(&buf[2], "%d;%d", rows, cols) != 2) return -1;
+    int e = 0;
+    for(int c = 0; c < 256; ++c){
+        kt->bucket[c] = e;
+        while(e < n && (unsigned char)kt->entries[e].word[0] == c) e++;
+    }
+    kt->bucket[256] = n;
 
-    return 0;
+    return kt;
 }
 
-int GetTerminalSize(int* rows, int* cols){
-    struct winsize ws;
+// Returns the keyword class of the identifier at text, or HL_NORMAL
+int KeywordTableMatch(struct keywordTable* kt, const char* text, int len, int* matchLen){
+    int idLen = 0;
+    while(idLen < len && idLen <= kt->maxLen && !IsSeparator(text[idLen])) idLen++;
+    if(idLen == 0 || idLen > kt->maxLen) return HL_NORMAL;
 
-    if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0){
-        if(write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) return -1; // If we cant move cursor to bottom right return (fallback for ioctl)
-        return GetCursorPosition(rows, cols);
+    unsigned char first = text[0];
+    for(int e = kt->bucket[first]; e < kt->bucket[first + 1]; ++e){
+        struct keywordEntry* k = &kt->entries[e];
+        if(k->len > idLen) break;
+
+        if(k->len == idLen && !memcmp(text, k->word, idLen)){
+            *matchLen = idLen;
+            return k->hl;
+        }
     }
-    else {
-        *cols = ws.ws_col;
-        *rows = ws.ws_row;
-        return 0;
+
+    return HL_NORMAL;
+}
+
+void EditorCompileSyntaxDB(){
+    for(unsigned int j = 0; j < HLDB_ENTRIES; ++j){
+        if(HLDB[j].keywords && HLDB[j].compiled == NULL){
+            HLDB[j].compiled = KeywordTableCompile(HLDB[j].keywords);
+        }
     }
 }
 
-/*==== SYNTAX HIGHLIGHTING ====*/
+// Bytes past a position the highlighter may look at before moving over it
+int EditorHighlightReach(){
+    struct EditorSyntax* syntax = E.buf->syntax;
+    if(syntax == NULL) return 0;
 
-int IsSeparator(int c){
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
-}
+    int reach = 2; // A string escape
+    if(syntax->compiled && syntax->compiled->maxLen + 1 > reach) reach = syntax->compiled->maxLen + 1;
+
+    char* delims[] = {syntax->singleLineCommentStart, syntax->multilineCommentStart, syntax->multilineCommentEnd};
+    for(int j = 0; j < 3; ++j){
+        if(delims[j] && (int)strlen(delims[j]) > reach) reach = strlen(delims[j]);
+    }
 
-void EditorUpdateSyntax(eRow* row){
-    row->highlight = realloc(row->highlight, row->rndrSize);
-    memset(row->highlight, HL_NORMAL, row->rndrSize);
+    return reach;
+}
 
-    if(E.syntax == NULL) return;
+// Highlights text from byte i on into hl, where hl[0] is byte i, until it gets
+// to end. A token running over end is finished, so it stops at the first
+// position at or after end and returns it, having written hl up to there.
+// The state at i is taken from s and what it is at the stop is left there.
+int EditorHighlightSpan(const char* text, int len, int i, int end, unsigned char* hl, struct hlState* s){
+    int from = i;
+    memset(hl, HL_NORMAL, end - from);
+
+    if(E.buf->syntax == NULL) return end;
+    if(s->lineComment){
+        memset(hl, HL_COMMENT, end - from);
+        return end;
+    }
 
-    char** keywords = E.syntax->keywords;
+    struct keywordTable* keywords = E.buf->syntax->compiled;
 
-    char* scs = E.syntax->singleLineCommentStart;
-    char* mcs = E.syntax->multilineCommentStart;
-    char* mce = E.syntax->multilineCommentEnd;
+    char* scs = E.buf->syntax->singleLineCommentStart;
+    char* mcs = E.buf->syntax->multilineCommentStart;
+    char* mce = E.buf->syntax->multilineCommentEnd;
 
     int scsLen = scs ? strlen(scs) : 0;
     int mcsLen = mcs ? strlen(mcs) : 0;
     int mceLen = mce ? strlen(mce) : 0;
 
-    int prevSep = 1;
-    int inString = 0;
-    int inComment = (row->idx > 0 && E.row[row->idx - 1].hlOpenComment);
+    int inComment = s->inComment;
+    int prevSep = s->prevSep;
+    int inString = s->inString;
 
-    int i = 0;
-    while(i < row->rndrSize){
-        char c = row->render[i];
-        unsigned char prevHL = (i > 0) ? row->highlight[i - 1] : HL_NORMAL;
+    while(i < end){
+        char c = text[i];
+        unsigned char prevHL = (i > from) ? hl[i - from - 1] : s->prevHL;
 
         if(scsLen && !inString && !inComment){
-            if(!strncmp(&row->render[i], scs, scsLen)){
-                memset(&row->highlight[i], HL_COMMENT, row->rndrSize - i);
+            if(i + scsLen <= len && !strncmp(&text[i], scs, scsLen)){
+                memset(&hl[i - from], HL_COMMENT, end - i);
+                s->lineComment = 1;
+                i = end;
                 break;
             }
         }
 
         if(mcsLen && mceLen && !inString){
             if(inComment){
-                row->highlight[i] = HL_MCOMMENT;
-                if(!strncmp(&row->render[i], mce, mceLen)){
-                    memset(&row->highlight[i], HL_MCOMMENT, mceLen);
+                hl[i - from] = HL_MCOMMENT;
+                if(i + mceLen <= len && !strncmp(&text[i], mce, mceLen)){
+                    memset(&hl[i - from], HL_MCOMMENT, mceLen);
                     i += mceLen;
                     inComment = 0;
                     prevSep = 1;
@@ -291,20 +844,20 @@ void EditorUpdateSyntax(eRow* row){
                     continue;
                 }
             }
-            else if(!strncmp(&row->render[i], mcs, mcsLen)){
-                memset(&row->highlight[i], HL_MCOMMENT, mcsLen);
+            else if(i + mcsLen <= len && !strncmp(&text[i], mcs, mcsLen)){
+                memset(&hl[i - from], HL_MCOMMENT, mcsLen);
                 i += mcsLen;
                 inComment = 1;
                 continue;
             }
         }
 
-        if(E.syntax->flags & HL_HIGHLIGHT_STRINGS){
+        if(E.buf->syntax->flags & HL_HIGHLIGHT_STRINGS){
             if(inString){
-                row->highlight[i] = HL_STRING;
+                hl[i - from] = HL_STRING;
 
-                if(c == '\\' && i + 1 < row->rndrSize){
-                    row->highlight[i + 1] = HL_STRING;
+                if(c == '\\' && i + 1 < len){
+                    hl[i - from + 1] = HL_STRING;
                     i += 2;
                     continue;
                 }
@@ -318,37 +871,29 @@ void EditorUpdateSyntax(eRow* row){
             else {
                 if(c == '"' || c == '\''){
                     inString = c;
-                    row->highlight[i] = HL_STRING;
+                    hl[i - from] = HL_STRING;
                     ++i;
                     continue;
                 }
             }
         }
 
-        if(E.syntax->flags & HL_HIGHLIGHT_NUMBERS){
+        if(E.buf->syntax->flags & HL_HIGHLIGHT_NUMBERS){
             if((isdigit(c) && (prevSep || prevHL == HL_NUMBER)) || (c == '.' && prevHL == HL_NUMBER)){
-                row->highlight[i] = HL_NUMBER;
+                hl[i - from] = HL_NUMBER;
                 i++;
                 prevSep = 0;
                 continue;
             }
         }
 
-        if(prevSep){
-            int j;
-            for(j = 0; keywords[j]; ++j){
-                int kLen = strlen(keywords[j]);
-                int kw2 = keywords[j][kLen - 1] == '|';
+        if(prevSep && keywords){
+            int kLen;
+            int kw = KeywordTableMatch(keywords, &text[i], len - i, &kLen);
 
-                if(kw2) kLen--;
-
-                if(!strncmp(&row->render[i], keywords[j], kLen) && IsSeparator(row->render[i + kLen])){
-                    memset(&row->highlight[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, kLen);
-                    i += kLen;
-                    break;
-                }
-            }
-            if(keywords[j] != NULL){
+            if(kw != HL_NORMAL){
+                memset(&hl[i - from], kw, kLen);
+                i += kLen;
                 prevSep = 0;
                 continue;
             }
@@ -358,13 +903,117 @@ void EditorUpdateSyntax(eRow* row){
         ++i;
     }
 
-    int changed = (row->hlOpenComment != inComment);
-    row->hlOpenComment = inComment;
-    if(changed && row->idx + 1 < E.numRows){
-        EditorUpdateSyntax(&E.row[row->idx + 1]);
+    if(i > from) s->prevHL = hl[i - from - 1];
+    s->inComment = inComment;
+    s->prevSep = prevSep;
+    s->inString = inString;
+    return i;
+}
+
+// Highlights len bytes of text into hl, returns whether a multiline comment is
+// still open at the end. text does not need to be nul terminated.
+int EditorHighlightText(const char* text, int len, unsigned char* hl, int inComment){
+    struct hlState s = {inComment, 0, 1, HL_NORMAL, 0};
+    EditorHighlightSpan(text, len, 0, len, hl, &s);
+    return E.buf->syntax ? s.inComment : 0;
+}
+
+// Rows that are not materialized only need their comment state, so they are
+// highlighted into a shared scratch buffer that is thrown away
+unsigned char* EditorSyntaxScratch(int len){
+    static unsigned char* scratch = NULL;
+    static int scratchCap = 0;
+
+    if(len > scratchCap){
+        scratchCap = len * 2;
+        scratch = realloc(scratch, scratchCap);
+        if(scratch == NULL) Die("realloc");
+    }
+
+    return scratch;
+}
+
+// Rehighlights a single row and returns whether its comment state changed. A
+// state of -1 means the row has not been highlighted since it or the row above
+// it last changed.
+int EditorUpdateSyntax(int at){
+    int inComment = (at > 0 && *EditorRowHlState(at - 1) > 0);
+    eRow* row = EditorRowAt(at);
+    int open;
+
+    if(row && row->chunked){
+        struct hlState start = {inComment, 0, 1, HL_NORMAL, 0};
+        row->chunks[0].state = start;
+        EditorLongRowScan(at, 0);
+        open = row->chunkOpen;
+    }
+    else if(row){
+        open = EditorHighlightText(row->render, row->rndrSize, row->highlight, inComment);
+    }
+    else {
+        int size = EditorRowSize(at);
+        open = EditorHighlightText(EditorRowText(at), size, EditorSyntaxScratch(size), inComment);
+    }
+
+    signed char* state = EditorRowHlState(at);
+    int changed = (*state != open);
+    *state = open;
+    return changed;
+}
+
+void EditorSyntaxInvalidate(int at){
+    *EditorRowHlState(at) = -1;
+    if(at < E.buf->hlFrontier) E.buf->hlFrontier = at;
+}
+
+// Carries a changed comment state down from row at until it stops changing.
+// Only rows on screen are redone right away, the rest is left to EditorSyntaxIdle.
+void EditorSyntaxPropagate(int at){
+    int end = E.buf->rowOff + E.terminalRows;
+
+    for(int r = at + 1; r < E.buf->numRows; ++r){
+        if(r >= end){
+            EditorSyntaxInvalidate(r);
+            return;
+        }
+
+        if(!EditorUpdateSyntax(r)) return;
+    }
+}
+
+int EditorSyntaxPending(){
+    return E.buf->syntax && E.buf->hlFrontier < E.buf->numRows;
+}
+
+// Highlights a slice of the rows from E.buf->hlFrontier on, called while waiting for
+// input. Returns whether a row on screen changed.
+int EditorSyntaxIdle(){
+    int redraw = 0;
+    int carry = 0;
+    int work = 0;
+    int scanned = 0;
+
+    while(E.buf->hlFrontier < E.buf->numRows && work < JEDITOR_HL_BUDGET && scanned < JEDITOR_HL_BUDGET * 32){
+        int at = E.buf->hlFrontier;
+
+        if(carry || *EditorRowHlState(at) == -1){
+            carry = EditorUpdateSyntax(at);
+            if(at >= E.buf->rowOff && at < E.buf->rowOff + E.terminalRows) redraw = 1;
+            work++;
+        }
+
+        scanned++;
+        E.buf->hlFrontier++;
+    }
+
+    if(carry && E.buf->hlFrontier < E.buf->numRows){
+        EditorSyntaxInvalidate(E.buf->hlFrontier);
     }
+
+    return redraw;
 }
 
+
 int EditorSyntaxToColor(int hl){
     switch(hl){
     case HL_COMMENT:
@@ -379,10 +1028,10 @@ int EditorSyntaxToColor(int hl){
 }
 
 void EditorSelectSyntaxHighlight(){
-    E.syntax = NULL;
-    if(E.filename == NULL) return;
+    E.buf->syntax = NULL;
+    if(E.buf->filename == NULL) return;
 
-    char* ext = strrchr(E.filename, '.');
+    char* ext = strrchr(E.buf->filename, '.');
 
     for(unsigned int j = 0; j < HLDB_ENTRIES; ++j){
         struct EditorSyntax* s = &HLDB[j];
@@ -390,410 +1039,3954 @@ void EditorSelectSyntaxHighlight(){
         unsigned int i = 0;
         while(s->filematch[i]){
             int isExt = (s->filematch[i][0] == '.');
-            if((isExt && ext && !strcmp(ext, s->filematch[i])) || (!isExt && strstr(E.filename, s->filematch[i]))){
-                E.syntax = s;
-            }
-
-            int filerow;
-            for(filerow = 0; filerow < E.numRows; ++filerow){
-                EditorUpdateSyntax(&E.row[filerow]);
+            if((isExt && ext && !strcmp(ext, s->filematch[i])) || (!isExt && strstr(E.buf->filename, s->filematch[i]))){
+                E.buf->syntax = s;
             }
 
             i++;
         }
     }
+
+    if(E.buf->rows.hlState) memset(E.buf->rows.hlState, -1, E.buf->rows.cap);
+    E.buf->hlFrontier = 0;
 }
 
-/*==== ROW OPERATIONS ====*/
+/*==== ROW MEMORY ====*/
 
-int EditorRowCurXToRndrX(eRow* row, int curX){
-    int rx = 0;
-    int j;
-    for(j = 0; j < curX; ++j){
-        if(row->chars[j] == '\t')
-            rx += (JEDITOR_TAB_STOP - 1) - (rx % JEDITOR_TAB_STOP);
+// Row buffers come from here instead of malloc. Materialized rows take power
+// of two blocks from per size class free lists, carved out of large slab pages.
+// Rows loaded from something that cannot be mapped are copied into a bump
+// arena and then treated like mapped rows. All of it is released at once when
+// the rows are dropped, and the counters show what a buffer is using.
 
-        rx++;
-    }
+#define ROW_MEM_MIN 16
+#define ROW_MEM_MAX (ROW_MEM_MIN << (ROW_MEM_CLASSES - 1))
+#define ROW_MEM_PAGE (256 << 10)
+#define ROW_MEM_ARENA_BLOCK (1 << 20)
+#define ROW_MEM_HEADER 16 // struct rowMemBlock, padded to keep blocks aligned
 
-    return rx;
+int RowMemClass(size_t size){
+    int k = 0;
+    while((size_t)(ROW_MEM_MIN << k) < size) k++;
+    return k;
 }
 
-int EditorRowRendrXToCurX(eRow* row, int rowX){
-    int curRx = 0;
-    int cx;
-    for(cx = 0; cx < row->size; cx++){
-        if(row->chars[cx] == '\t')
-            curRx += (JEDITOR_TAB_STOP - 1) - (curRx % JEDITOR_TAB_STOP);
-
-        curRx++;
+char* RowMemNewBlock(struct rowMemBlock** list, size_t size){
+    struct rowMemBlock* block = malloc(ROW_MEM_HEADER + size);
+    if(block == NULL) Die("malloc");
 
-        if(curRx > rowX) return cx; 
-    }
+    block->prev = NULL;
+    block->next = *list;
+    if(*list) (*list)->prev = block;
+    *list = block;
 
-    return cx;
+    return (char*)block + ROW_MEM_HEADER;
 }
 
-void EditorUpdateRow(eRow* row){
-    int tabs = 0;
-    int j;
+void RowMemPush(struct rowMem* m, void* ptr, int k){
+    *(void**)ptr = m->freeList[k];
+    m->freeList[k] = ptr;
+}
 
-    for(j = 0; j < row->size; ++j){
-        if(row->chars[j] == '\t') 
-            tabs++;
+// Allocates size bytes, which must be a power of two of at least ROW_MEM_MIN
+void* RowMemAlloc(struct rowMem* m, size_t size){
+    if(size > ROW_MEM_MAX){
+        m->largeInUse += size;
+        return RowMemNewBlock(&m->large, size);
     }
 
-    free(row->render);
-    row->render = malloc(row->size + tabs * (JEDITOR_TAB_STOP - 1) + 1);
+    int k = RowMemClass(size);
+    m->slabInUse += size;
 
-    int idx = 0;
-    for(j = 0; j < row->size; ++j){
-        if(row->chars[j] == '\t'){
-            row->render[idx++] = ' ';
-            while(idx % JEDITOR_TAB_STOP != 0) row->render[idx++] = ' ';
+    void* ptr = m->freeList[k];
+    if(ptr){
+        m->freeList[k] = *(void**)ptr;
+        return ptr;
+    }
+
+    if(m->slabLeft < size){
+        while(m->slabLeft >= ROW_MEM_MIN){ // Hand what is left of the page to smaller classes
+            int j = RowMemClass(m->slabLeft + 1) - 1;
+            RowMemPush(m, m->slab, j);
+            m->slab += ROW_MEM_MIN << j;
+            m->slabLeft -= ROW_MEM_MIN << j;
+        }
+
+        m->slab = RowMemNewBlock(&m->pages, ROW_MEM_PAGE);
+        m->slabLeft = ROW_MEM_PAGE;
+        m->slabReserved += ROW_MEM_PAGE;
+    }
+
+    ptr = m->slab;
+    m->slab += size;
+    m->slabLeft -= size;
+    return ptr;
+}
+
+void RowMemFree(struct rowMem* m, void* ptr, size_t size){
+    if(ptr == NULL) return;
+
+    if(size > ROW_MEM_MAX){
+        struct rowMemBlock* block = (struct rowMemBlock*)((char*)ptr - ROW_MEM_HEADER);
+        if(block->prev) block->prev->next = block->next;
+        else m->large = block->next;
+        if(block->next) block->next->prev = block->prev;
+
+        free(block);
+        m->largeInUse -= size;
+        return;
+    }
+
+    RowMemPush(m, ptr, RowMemClass(size));
+    m->slabInUse -= size;
+}
+
+void* RowMemGrow(struct rowMem* m, void* ptr, size_t oldSize, size_t newSize){
+    void* grown = RowMemAlloc(m, newSize);
+    if(ptr){
+        memcpy(grown, ptr, oldSize);
+        RowMemFree(m, ptr, oldSize);
+    }
+
+    return grown;
+}
+
+// Copies a loaded row into the arena, where it stays until everything is released
+const char* RowMemCopyText(struct rowMem* m, const char* text, size_t len){
+    if(m->arenaLeft < len){
+        size_t size = len > ROW_MEM_ARENA_BLOCK ? len : ROW_MEM_ARENA_BLOCK;
+        m->arena = RowMemNewBlock(&m->pages, size);
+        m->arenaLeft = size;
+        m->arenaReserved += size;
+    }
+
+    char* copy = m->arena;
+    memcpy(copy, text, len);
+    m->arena += len;
+    m->arenaLeft -= len;
+    m->arenaUsed += len;
+
+    return copy;
+}
+
+void RowMemFreeList(struct rowMemBlock* block){
+    while(block){
+        struct rowMemBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+}
+
+void RowMemRelease(struct rowMem* m){
+    RowMemFreeList(m->pages);
+    RowMemFreeList(m->large);
+    memset(m, 0, sizeof(*m));
+}
+
+void EditorShowMemory(){
+    struct rowMem* m = &E.buf->mem;
+    EditorSetStatusMessage("Rows: %zuK in use of %zuK | Loaded text: %zuK of %zuK",
+                           (m->slabInUse + m->largeInUse) >> 10, (m->slabReserved + m->largeInUse) >> 10,
+                           m->arenaUsed >> 10, m->arenaReserved >> 10);
+}
+
+/*==== ROW STORE ====*/
+
+// The row arrays are a gap buffer: rows [0, gap) sit at the front of each
+// allocation, the remaining rows at the back, with the unused slots in between.
+// Inserting or deleting a row only has to move the gap to it, which is free for
+// repeated edits in the same place instead of shifting every following row.
+
+#define ROW_GAP_LEN (E.buf->rows.cap - E.buf->numRows)
+
+int EditorRowSlot(int at){
+    return at < E.buf->rows.gap ? at : at + ROW_GAP_LEN;
+}
+
+// The row's materialized data, or NULL
+eRow* EditorRowAt(int at){
+    return E.buf->rows.data[EditorRowSlot(at)];
+}
+
+int EditorRowSize(int at){
+    return E.buf->rows.size[EditorRowSlot(at)];
+}
+
+// The row's bytes whether or not it has been materialized, not nul terminated
+const char* EditorRowText(int at){
+    return E.buf->rows.text[EditorRowSlot(at)];
+}
+
+signed char* EditorRowHlState(int at){
+    return &E.buf->rows.hlState[EditorRowSlot(at)];
+}
+
+void EditorRowShift(int to, int from, int count){
+    memmove(&E.buf->rows.size[to], &E.buf->rows.size[from], sizeof(*E.buf->rows.size) * count);
+    memmove(&E.buf->rows.text[to], &E.buf->rows.text[from], sizeof(*E.buf->rows.text) * count);
+    memmove(&E.buf->rows.hlState[to], &E.buf->rows.hlState[from], sizeof(*E.buf->rows.hlState) * count);
+    memmove(&E.buf->rows.data[to], &E.buf->rows.data[from], sizeof(*E.buf->rows.data) * count);
+}
+
+void EditorRowMoveGap(int at){
+    if(at < E.buf->rows.gap){
+        EditorRowShift(at + ROW_GAP_LEN, at, E.buf->rows.gap - at);
+    }
+    else if(at > E.buf->rows.gap){
+        EditorRowShift(E.buf->rows.gap, E.buf->rows.gap + ROW_GAP_LEN, at - E.buf->rows.gap);
+    }
+    E.buf->rows.gap = at;
+}
+
+// Grows one of the row arrays, moving the rows after the gap to its new end
+void* EditorRowArrayGrow(void* array, size_t elemSize, int newCap){
+    int tail = E.buf->numRows - E.buf->rows.gap;
+
+    char* grown = realloc(array, elemSize * newCap);
+    if(grown == NULL) Die("realloc");
+
+    memmove(grown + elemSize * (newCap - tail), grown + elemSize * (E.buf->rows.cap - tail), elemSize * tail);
+    return grown;
+}
+
+void EditorRowReserve(int count){
+    if(ROW_GAP_LEN >= count) return;
+
+    int newCap = E.buf->rows.cap ? E.buf->rows.cap * 2 : 64;
+    while(newCap - E.buf->numRows < count) newCap *= 2;
+
+    E.buf->rows.size = EditorRowArrayGrow(E.buf->rows.size, sizeof(*E.buf->rows.size), newCap);
+    E.buf->rows.text = EditorRowArrayGrow(E.buf->rows.text, sizeof(*E.buf->rows.text), newCap);
+    E.buf->rows.hlState = EditorRowArrayGrow(E.buf->rows.hlState, sizeof(*E.buf->rows.hlState), newCap);
+    E.buf->rows.data = EditorRowArrayGrow(E.buf->rows.data, sizeof(*E.buf->rows.data), newCap);
+    E.buf->rows.cap = newCap;
+}
+
+/*==== ROW OPERATIONS ====*/
+
+// Decodes the character at str, returning its length in bytes and its width
+// in columns. Bytes that are not valid UTF-8, and characters the terminal
+// cannot print, are one byte of width -1 and get shown as an inverted '?'.
+int Utf8Char(const char* str, int len, int* width){
+    const unsigned char* s = (const unsigned char*)str;
+    *width = 1;
+    if(s[0] < 0x80) return 1;
+
+    int n = (s[0] >= 0xf0) ? 4 : (s[0] >= 0xe0) ? 3 : (s[0] >= 0xc2) ? 2 : 0;
+    *width = -1;
+    if(n == 0 || n > len || s[0] > 0xf4) return 1;
+
+    wchar_t cp = s[0] & (0x7f >> n);
+    for(int k = 1; k < n; ++k){
+        if((s[k] & 0xc0) != 0x80) return 1;
+        cp = (cp << 6) | (s[k] & 0x3f);
+    }
+
+    if((n == 3 && cp < 0x800) || (n == 4 && cp < 0x10000) || (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff) return 1;
+
+    *width = wcwidth(cp);
+    return n;
+}
+
+int Utf8IsContinuation(char c){
+    return ((unsigned char)c & 0xc0) == 0x80;
+}
+
+// Start of the character holding byte at of text, as Utf8Char reads it. A
+// continuation byte that no lead covers is a character of its own.
+int Utf8CharStart(const char* text, int len, int at){
+    int from = at;
+    while(from > 0 && at - from < 3 && Utf8IsContinuation(text[from])) from--;
+
+    int width;
+    return from + Utf8Char(text + from, len - from, &width) > at ? from : at;
+}
+
+int TextIsAsciiScalar(const char* text, int len){
+    int i = 0;
+    for(; i + 8 <= len; i += 8){
+        uint64_t word;
+        memcpy(&word, text + i, 8);
+        if(word & 0x8080808080808080ull) return 0;
+    }
+
+    for(; i < len; ++i){
+        if((unsigned char)text[i] >= 0x80) return 0;
+    }
+
+    return 1;
+}
+
+#ifdef JEDITOR_X86
+__attribute__((target("sse2")))
+int TextIsAsciiSSE2(const char* text, int len){
+    __m128i any = _mm_setzero_si128();
+    int i = 0;
+    for(; i + 16 <= len; i += 16) any = _mm_or_si128(any, _mm_loadu_si128((const __m128i*)(text + i)));
+
+    if(_mm_movemask_epi8(any)) return 0;
+    return TextIsAsciiScalar(text + i, len - i);
+}
+#endif
+
+int TextIsAscii(const char* text, int len){
+#ifdef JEDITOR_X86
+    if(__builtin_cpu_supports("sse2")) return TextIsAsciiSSE2(text, len);
+#endif
+    return TextIsAsciiScalar(text, len);
+}
+
+// Moves *j past the character of chars or render that starts there, at column
+// col, and returns the column after it. Both end in a '\0', which stops a
+// character cut short.
+int EditorRowStep(const char* text, int* j, int col){
+    unsigned char c = text[*j];
+    if(c == '\t'){
+        (*j)++;
+        return col + JEDITOR_TAB_STOP - col % JEDITOR_TAB_STOP;
+    }
+
+    if(c < 0x80){
+        (*j)++;
+        return col + 1;
+    }
+
+    int width;
+    *j += Utf8Char(&text[*j], 4, &width);
+    return col + (width < 0 ? 1 : width);
+}
+
+// Column of byte to of chars, walking there from byte j at column col
+int EditorRowWalk(const char* chars, int j, int to, int col){
+    while(j < to){
+        unsigned char c = chars[j];
+        if(c < 0x80 && c != '\t'){
+            j++;
+            col++;
+        }
+        else {
+            col = EditorRowStep(chars, &j, col);
+        }
+    }
+
+    return col;
+}
+
+// Last chunk of a long row at or before byte curX of chars
+int EditorRowChunkAt(eRow* row, int curX){
+    int lo = 1, hi = row->numChunks; // The first chunk is at 0
+    while(lo < hi){
+        int mid = (lo + hi) / 2;
+        if(row->chunks[mid].at <= curX) lo = mid + 1;
+        else hi = mid;
+    }
+
+    return lo - 1;
+}
+
+// Last chunk of a long row at or before column rx
+int EditorRowChunkAtCol(eRow* row, int rx){
+    int lo = 1, hi = row->numChunks;
+    while(lo < hi){
+        int mid = (lo + hi) / 2;
+        if(row->chunks[mid].col <= rx) lo = mid + 1;
+        else hi = mid;
+    }
+
+    return lo - 1;
+}
+
+// Last mark at or before byte curX of chars, where a walk to it can start.
+// Rows without marks are short and walked from their start, long ones start
+// from a chunk.
+struct rowMark EditorRowMarkAt(eRow* row, int curX){
+    struct rowMark start = {0, 0, 0};
+    if(row->chunked){
+        struct rowChunk* c = &row->chunks[EditorRowChunkAt(row, curX)];
+        struct rowMark m = {c->at, 0, c->col};
+        return m;
+    }
+
+    if(row->numMarks == 0) return start;
+
+    int m = curX / JEDITOR_ROW_MARK;
+    if(m >= row->numMarks) m = row->numMarks - 1;
+    if(row->marks[m].chars > curX) m--; // The mark fell on a later byte of the character at curX
+
+    return m < 0 ? start : row->marks[m];
+}
+
+// Last mark at or before column rx
+struct rowMark EditorRowMarkAtCol(eRow* row, int rx){
+    struct rowMark start = {0, 0, 0};
+    if(row->chunked){
+        struct rowChunk* c = &row->chunks[EditorRowChunkAtCol(row, rx)];
+        struct rowMark m = {c->at, 0, c->col};
+        return m;
+    }
+
+    int lo = 0, hi = row->numMarks;
+    while(lo < hi){
+        int mid = (lo + hi) / 2;
+        if(row->marks[mid].col <= rx) lo = mid + 1;
+        else hi = mid;
+    }
+
+    return lo == 0 ? start : row->marks[lo - 1];
+}
+
+// Bytes of chars from *from to *to hold every character shown in columns col
+// to col + cols. The window of a long row must be filled for them already.
+void EditorRowColsToBytes(eRow* row, int size, int col, int cols, int* from, int* to){
+    if(row->chunked){
+        *from = row->winAt;
+        *to = row->winEnd;
+    }
+    else if(row->ascii && !row->tabs){
+        *from = col < size ? col : size;
+        *to = col + cols < size ? col + cols : size;
+    }
+    else {
+        *from = EditorRowMarkAtCol(row, col).chars;
+
+        int lo = 0, hi = row->numMarks; // First mark at or past the last column
+        while(lo < hi){
+            int mid = (lo + hi) / 2;
+            if(row->marks[mid].col < col + cols) lo = mid + 1;
+            else hi = mid;
+        }
+        *to = lo < row->numMarks ? row->marks[lo].chars : size;
+    }
+}
+
+int EditorRowCurXToRndrX(eRow* row, int curX){
+    if(row->ascii && !row->tabs) return curX;
+
+    struct rowMark m = EditorRowMarkAt(row, curX);
+    return EditorRowWalk(row->chars, m.chars, curX, m.col);
+}
+
+// Byte of render holding column col, and in *start the column its character
+// starts at, which is before col for the right half of a wide one. The window
+// of a long row must hold col.
+int EditorRowRenderAt(eRow* row, int col, int* start){
+    if(row->ascii){
+        *start = col;
+        return col;
+    }
+
+    struct rowMark m = {0, 0, row->winCol}; // The window of a long row is walked from its start
+    if(!row->chunked) m = EditorRowMarkAtCol(row, col);
+
+    int idx = m.render;
+    int rx = m.col;
+    while(idx < row->rndrSize){
+        int next = idx;
+        int after = EditorRowStep(row->render, &next, rx);
+        if(after > col) break;
+        idx = next;
+        rx = after;
+    }
+
+    *start = rx;
+    return idx;
+}
+
+// Rows keep spare capacity so edits grow their buffers geometrically instead
+// of reallocating them on every keystroke
+int RowCapFor(int cap, int need){
+    if(cap >= need) return cap;
+
+    cap = cap ? cap : 16;
+    while(cap < need) cap *= 2;
+    return cap;
+}
+
+void EditorRowReserveChars(int at, int len){
+    eRow* row = EditorRowAt(at);
+    if(row->charsCap > len) return;
+
+    int cap = RowCapFor(row->charsCap, len + 1);
+    row->chars = RowMemGrow(&E.buf->mem, row->chars, row->charsCap, cap);
+    row->charsCap = cap;
+    E.buf->rows.text[EditorRowSlot(at)] = row->chars;
+}
+
+void EditorRowReserveRender(eRow* row, int len){
+    if(row->rndrCap > len) return;
+
+    int cap = RowCapFor(row->rndrCap, len + 1);
+    row->render = RowMemGrow(&E.buf->mem, row->render, row->rndrCap, cap);
+    row->highlight = RowMemGrow(&E.buf->mem, row->highlight, row->rndrCap, cap);
+    row->rndrCap = cap;
+}
+
+void EditorRowReserveMarks(eRow* row, int count){
+    int need = count * sizeof(struct rowMark);
+    if(row->marksCap >= need) return;
+
+    int cap = RowCapFor(row->marksCap, need);
+    row->marks = RowMemGrow(&E.buf->mem, row->marks, row->marksCap, cap);
+    row->marksCap = cap;
+}
+
+void EditorRowReserveChunks(eRow* row, int count){
+    int need = count * sizeof(struct rowChunk);
+    if(row->chunksCap >= need) return;
+
+    int cap = RowCapFor(row->chunksCap, need);
+    row->chunks = RowMemGrow(&E.buf->mem, row->chunks, row->chunksCap, cap);
+    row->chunksCap = cap;
+}
+
+int HlStateEqual(struct hlState* a, struct hlState* b){
+    return a->inComment == b->inComment && a->inString == b->inString && a->prevSep == b->prevSep &&
+           a->prevHL == b->prevHL && a->lineComment == b->lineComment;
+}
+
+// Chunks found by a rescan before they replace the old ones
+struct rowChunk* EditorChunkScratch(int count){
+    static struct rowChunk* scratch = NULL;
+    static int scratchCap = 0;
+
+    if(count > scratchCap){
+        scratchCap = count * 2;
+        scratch = realloc(scratch, sizeof(*scratch) * scratchCap);
+        if(scratch == NULL) Die("realloc");
+    }
+
+    return scratch;
+}
+
+// Highlights long row at again from chunk k on, recording a chunk about every
+// JEDITOR_ROW_CHUNK bytes. Chunks after k are the ones from before the change,
+// moved to where their text is now. Once the highlighter gets to one of them
+// in the same state, and at a column that keeps tab stops where they were,
+// the rest of the row is as it was and only its columns move.
+void EditorLongRowScan(int at, int k){
+    eRow* row = EditorRowAt(at);
+    int size = EditorRowSize(at);
+    int reach = EditorHighlightReach();
+    int n = row->numChunks;
+    int old = k + 1; // First old chunk not passed yet
+    int fresh = 0;
+    int same = -1;   // Old chunk the scan caught up with
+    int colDelta = 0;
+    int lastTabs = -1; // Old chunk with the last tab in it
+    struct rowChunk cur = row->chunks[k];
+
+    for(int j = old; j < n; ++j){
+        if(row->chunks[j].tabs) lastTabs = j;
+    }
+
+    row->winEnd = -1;
+
+    while(1){
+        while(old < n && row->chunks[old].at <= cur.at) old++;
+
+        int target = cur.at + JEDITOR_ROW_CHUNK;
+        if(old < n && row->chunks[old].at < target + JEDITOR_ROW_CHUNK) target = row->chunks[old].at;
+        if(target > size) target = size;
+
+        struct hlState state = cur.state;
+        unsigned char* hl = EditorSyntaxScratch(target - cur.at + 4 * (reach + 4));
+        int stop = EditorHighlightSpan(row->chars, size, cur.at, target, hl, &state);
+        while(stop < size && Utf8IsContinuation(row->chars[stop])){ // Chunks start on a character
+            stop = EditorHighlightSpan(row->chars, size, stop, stop + 1, &hl[stop - cur.at], &state);
+        }
+
+        cur.tabs = memchr(&row->chars[cur.at], '\t', stop - cur.at) != NULL;
+        struct rowChunk* list = EditorChunkScratch(fresh + 1);
+        list[fresh++] = cur;
+
+        if(stop >= size){
+            row->chunkOpen = state.inComment;
+            break;
+        }
+
+        int col = EditorRowWalk(row->chars, cur.at, stop, cur.col);
+        if(old < n && row->chunks[old].at == stop && HlStateEqual(&row->chunks[old].state, &state)){
+            colDelta = col - row->chunks[old].col;
+            if(old > lastTabs || colDelta % JEDITOR_TAB_STOP == 0){
+                same = old;
+                break;
+            }
+        }
+
+        struct rowChunk next = {stop, col, state, 0};
+        cur = next;
+    }
+
+    int kept = (same >= 0) ? n - same : 0;
+    EditorRowReserveChunks(row, k + fresh + kept);
+    if(kept) memmove(&row->chunks[k + fresh], &row->chunks[same], sizeof(struct rowChunk) * kept);
+    memcpy(&row->chunks[k], EditorChunkScratch(0), sizeof(struct rowChunk) * fresh);
+    row->numChunks = k + fresh + kept;
+
+    for(int j = k + fresh; j < row->numChunks; ++j) row->chunks[j].col += colDelta;
+}
+
+// Fills render and highlight of long row at with the chunks around columns col
+// to col + cols, unless they are there already
+void EditorLongRowWindow(int at, int col, int cols){
+    eRow* row = EditorRowAt(at);
+    if(row->winEnd >= 0 && row->winCol <= col && (row->winColEnd < 0 || col + cols <= row->winColEnd)) return;
+
+    int size = EditorRowSize(at);
+    int a = EditorRowChunkAtCol(row, col);
+    int b = EditorRowChunkAtCol(row, col + cols - 1) + 1;
+    struct rowChunk* first = &row->chunks[a];
+
+    row->winAt = first->at;
+    row->winEnd = (b < row->numChunks) ? row->chunks[b].at : size;
+    row->winCol = first->col;
+    row->winColEnd = (b < row->numChunks) ? row->chunks[b].col : -1;
+
+    int len = row->winEnd - row->winAt;
+    int tabs = 0;
+    for(int j = row->winAt; j < row->winEnd; ++j) tabs += row->chars[j] == '\t';
+    EditorRowReserveRender(row, len + tabs * (JEDITOR_TAB_STOP - 1));
+
+    struct hlState state = first->state;
+    unsigned char* hl = EditorSyntaxScratch(len + EditorHighlightReach() + 1);
+    EditorHighlightSpan(row->chars, size, row->winAt, row->winEnd, hl, &state);
+
+    int idx = 0;
+    int rx = row->winCol;
+    for(int j = row->winAt; j < row->winEnd;){
+        int from = j;
+        int next = EditorRowStep(row->chars, &j, rx);
+        if(row->chars[from] == '\t'){
+            for(; rx < next; ++rx){
+                row->highlight[idx] = hl[from - row->winAt];
+                row->render[idx++] = ' ';
+            }
+        }
+        else {
+            for(; from < j; ++from){
+                row->highlight[idx] = hl[from - row->winAt];
+                row->render[idx++] = row->chars[from];
+            }
+            rx = next;
+        }
+    }
+
+    row->render[idx] = '\0';
+    row->rndrSize = idx;
+}
+
+void EditorUpdateRowSyntax(int at){
+    if(EditorUpdateSyntax(at)) EditorSyntaxPropagate(at);
+}
+
+// Starts a long row over from a single chunk and scans it all, which gives
+// its columns but leaves render and highlight to EditorLongRowWindow
+void EditorLongRowBuild(int at){
+    eRow* row = EditorRowAt(at);
+    struct rowChunk first = {0, 0, {at > 0 && *EditorRowHlState(at - 1) > 0, 0, 1, HL_NORMAL, 0}, 0};
+
+    row->chunked = 1;
+    row->ascii = 0;
+    row->numMarks = 0;
+    row->rndrSize = 0;
+    EditorRowReserveChunks(row, 1);
+    row->chunks[0] = first;
+    row->numChunks = 1;
+    EditorLongRowScan(at, 0);
+}
+
+// Rebuilds the render of a row without highlighting it
+void EditorUpdateRowRender(int at){
+    eRow* row = EditorRowAt(at);
+    int size = EditorRowSize(at);
+    int tabs = 0;
+    int j;
+
+    if(size > JEDITOR_LONG_ROW){
+        EditorLongRowBuild(at);
+        return;
+    }
+
+    row->chunked = 0;
+
+    for(j = 0; j < size; ++j){
+        if(row->chars[j] == '\t') 
+            tabs++;
+    }
+
+    row->tabs = tabs;
+    row->ascii = TextIsAscii(row->chars, size);
+    EditorRowReserveRender(row, size + tabs * (JEDITOR_TAB_STOP - 1));
+
+    // Long rows where bytes and columns differ remember where their columns
+    // are, so the cursor does not walk the whole row to find its own
+    int marked = (!row->ascii || tabs) && size > JEDITOR_ROW_MARK;
+    if(marked) EditorRowReserveMarks(row, size / JEDITOR_ROW_MARK + 1);
+    row->numMarks = 0;
+
+    if(row->ascii && !tabs){
+        memcpy(row->render, row->chars, size);
+        row->render[size] = '\0';
+        row->rndrSize = size;
+        return;
+    }
+
+    int idx = 0;
+    int col = 0;
+    for(j = 0; j < size;){
+        if(marked && j >= row->numMarks * JEDITOR_ROW_MARK){
+            struct rowMark m = {j, idx, col};
+            row->marks[row->numMarks++] = m;
+        }
+
+        unsigned char c = row->chars[j];
+        if(c == '\t'){
+            row->render[idx++] = ' ';
+            while(++col % JEDITOR_TAB_STOP != 0) row->render[idx++] = ' ';
+            j++;
+        }
+        else if(c < 0x80){
+            row->render[idx++] = c;
+            col++;
+            j++;
+        }
+        else {
+            int from = j;
+            col = EditorRowStep(row->chars, &j, col);
+            while(from < j) row->render[idx++] = row->chars[from++];
+        }
+    }
+
+    row->render[idx] = '\0';
+    row->rndrSize = idx;
+}
+
+void EditorUpdateRow(int at){
+    EditorUpdateRowRender(at);
+    EditorUpdateRowSyntax(at);
+}
+
+// A long row is only highlighted again from the last chunk the change cannot
+// reach back to, and only until it is the same as before the change
+void EditorLongRowSpan(int at, int col, int removed, int inserted){
+    eRow* row = EditorRowAt(at);
+    int reach = EditorHighlightReach();
+    int k = EditorRowChunkAt(row, col - reach);
+
+    int kept = k + 1;
+    for(int j = k + 1; j < row->numChunks; ++j){ // Move the chunks after the change with their text
+        if(row->chunks[j].at < col + removed) continue;
+
+        row->chunks[kept] = row->chunks[j];
+        row->chunks[kept++].at += inserted - removed;
+    }
+
+    row->numChunks = kept;
+    EditorLongRowScan(at, k);
+    EditorUpdateRowSyntax(at);
+}
+
+// Updates render after chars had removed bytes at col replaced by inserted new
+// ones. Plain ascii without tabs renders as a copy of chars, so only that span
+// is patched.
+void EditorUpdateRowSpan(int at, int col, int removed, int inserted){
+    eRow* row = EditorRowAt(at);
+    if(row->chunked != (EditorRowSize(at) > JEDITOR_LONG_ROW)){
+        EditorUpdateRow(at);
+        return;
+    }
+
+    if(row->chunked){
+        EditorLongRowSpan(at, col, removed, inserted);
+        return;
+    }
+
+    if(!row->ascii || row->tabs || memchr(&row->chars[col], '\t', inserted) || !TextIsAscii(&row->chars[col], inserted)){
+        EditorUpdateRow(at);
+        return;
+    }
+
+    int size = EditorRowSize(at);
+    EditorRowReserveRender(row, size);
+    memmove(&row->render[col + inserted], &row->render[col + removed], row->rndrSize - col - removed + 1);
+    memcpy(&row->render[col], &row->chars[col], inserted);
+    row->rndrSize = size;
+
+    EditorUpdateRowSyntax(at);
+}
+
+void EditorRowSetSize(int at, int size){
+    E.buf->rows.size[EditorRowSlot(at)] = size;
+}
+
+void EditorRowInsertSlot(int at, size_t len, const char* text){
+    EditorRowReserve(1);
+    EditorRowMoveGap(at);
+
+    E.buf->rows.size[at] = len;
+    E.buf->rows.text[at] = text;
+    E.buf->rows.hlState[at] = -1;
+    E.buf->rows.data[at] = NULL;
+    E.buf->rows.gap++;
+    E.buf->numRows++;
+}
+
+// Gives a row its chars, render and highlight
+eRow* EditorRowNewData(int at){
+    eRow* row = RowMemAlloc(&E.buf->mem, RowCapFor(0, sizeof(eRow)));
+    memset(row, 0, sizeof(*row));
+    E.buf->rows.data[EditorRowSlot(at)] = row;
+    return row;
+}
+
+void EditorInsertRow(int at, char* str, size_t len){
+    if(at < 0 || at > E.buf->numRows) return;
+
+    EditorRowInsertSlot(at, len, NULL);
+    eRow* row = EditorRowNewData(at);
+
+    EditorRowReserveChars(at, len);
+    memcpy(row->chars, str, len);
+    row->chars[len] = '\0';
+    EditorUpdateRow(at);
+
+    E.buf->dirty++;
+}
+
+// Adds a row that only points into the file mapping or the load arena. Its chars, render and highlight are
+// built by EditorRowMaterialize the first time it is drawn or edited.
+void EditorInsertMappedRow(int at, const char* str, size_t len){
+    if(at < 0 || at > E.buf->numRows) return;
+
+    EditorRowInsertSlot(at, len, str);
+    EditorSyntaxInvalidate(at);
+}
+
+eRow* EditorRowMaterialize(int at){
+    eRow* row = EditorRowAt(at);
+    if(row) return row;
+
+    const char* text = EditorRowText(at);
+    int size = EditorRowSize(at);
+
+    row = EditorRowNewData(at);
+    EditorRowReserveChars(at, size);
+    memcpy(row->chars, text, size);
+    row->chars[size] = '\0';
+    EditorUpdateRow(at);
+
+    return row;
+}
+
+void EditorFreeRow(int at){
+    eRow* row = EditorRowAt(at);
+    if(row == NULL) return;
+
+    RowMemFree(&E.buf->mem, row->render, row->rndrCap);
+    RowMemFree(&E.buf->mem, row->chars, row->charsCap);
+    RowMemFree(&E.buf->mem, row->highlight, row->rndrCap);
+    RowMemFree(&E.buf->mem, row->marks, row->marksCap);
+    RowMemFree(&E.buf->mem, row->chunks, row->chunksCap);
+    RowMemFree(&E.buf->mem, row, RowCapFor(0, sizeof(eRow)));
+}
+
+// Drops every row at once. Their memory goes back in bulk rather than row by row.
+void EditorFreeRows(){
+    RowMemRelease(&E.buf->mem);
+
+    SharedMapRelease(E.buf->map);
+    E.buf->map = NULL;
+
+    E.buf->numRows = 0;
+    E.buf->rows.gap = 0;
+    E.buf->hlFrontier = 0;
+}
+
+void EditorDelRow(int at){
+    if(at < 0 || at >= E.buf->numRows) return;
+
+    EditorFreeRow(at);
+    EditorRowMoveGap(at);
+    E.buf->numRows--; // The freed slot directly after the gap joins it
+
+    if(at < E.buf->hlFrontier) E.buf->hlFrontier--;
+    if(at < E.buf->numRows && EditorUpdateSyntax(at)) EditorSyntaxPropagate(at);
+    E.buf->dirty++;
+}
+
+void EditorRowInsertString(int at, int col, const char* str, size_t len){
+    int size = EditorRowSize(at);
+    if(col < 0 || col > size) col = size;
+
+    EditorRowReserveChars(at, size + len);
+    eRow* row = EditorRowAt(at);
+    memmove(&row->chars[col + len], &row->chars[col], size - col + 1);
+    memcpy(&row->chars[col], str, len);
+    EditorRowSetSize(at, size + len);
+    EditorUpdateRowSpan(at, col, 0, len);
+
+    E.buf->dirty++;
+}
+
+void EditorRowAppendString(int at, char* str, size_t len){
+    int size = EditorRowSize(at);
+    EditorRowReserveChars(at, size + len);
+    eRow* row = EditorRowAt(at);
+    memcpy(&row->chars[size], str, len);
+    row->chars[size + len] = '\0';
+    EditorRowSetSize(at, size + len);
+    EditorUpdateRowSpan(at, size, 0, len);
+    E.buf->dirty++;
+}
+
+void EditorRowDelString(int at, int col, size_t len){
+    int size = EditorRowSize(at);
+    if(col < 0 || col + (int)len > size) return;
+
+    eRow* row = EditorRowAt(at);
+    memmove(&row->chars[col], &row->chars[col + len], size - col - len + 1);
+    EditorRowSetSize(at, size - len);
+    EditorUpdateRowSpan(at, col, len, 0);
+    E.buf->dirty++;
+}
+
+// Removes count rows from at. The caller rehighlights what is left.
+void EditorDelRows(int at, int count){
+    for(int j = 0; j < count; ++j){
+        EditorFreeRow(at);
+        EditorRowMoveGap(at);
+        E.buf->numRows--;
+    }
+
+    if(E.buf->hlFrontier > at) E.buf->hlFrontier = E.buf->hlFrontier - count > at ? E.buf->hlFrontier - count : at;
+    E.buf->dirty++;
+}
+
+// Marks rows first to last for highlighting. Rows on screen are done as they
+// are drawn, the rest by EditorSyntaxIdle, so each is highlighted once.
+void EditorSyntaxInvalidateRange(int first, int last){
+    for(int r = last; r >= first; --r) EditorSyntaxInvalidate(r);
+}
+
+// Inserts text holding '\n' separated lines at (*at, *col) as a single splice:
+// every row it touches is rendered once. Leaves (*at, *col) after the text.
+void EditorRowsInsertText(int* at, int* col, const char* text, int len){
+    const char* nl = memchr(text, '\n', len);
+    if(nl == NULL){
+        EditorRowInsertString(*at, *col, text, len);
+        *col += len;
+        return;
+    }
+
+    int first = *at;
+    int lines = 0;
+    for(const char* p = nl; p; p = memchr(p + 1, '\n', text + len - p - 1)) lines++;
+    EditorRowReserve(lines);
+
+    // What follows col ends up after the last line
+    eRow* row = EditorRowMaterialize(first);
+    int tailLen = EditorRowSize(first) - *col;
+    char* tail = malloc(tailLen + 1);
+    if(tail == NULL) Die("malloc");
+    memcpy(tail, &row->chars[*col], tailLen);
+
+    int headLen = nl - text;
+    EditorRowReserveChars(first, *col + headLen);
+    row = EditorRowAt(first);
+    memcpy(&row->chars[*col], text, headLen);
+    row->chars[*col + headLen] = '\0';
+    EditorRowSetSize(first, *col + headLen);
+    EditorUpdateRowRender(first);
+
+    const char* p = nl + 1;
+    const char* end = text + len;
+    int y = first;
+
+    while(1){
+        const char* next = memchr(p, '\n', end - p);
+        int lineLen = (next ? next : end) - p;
+        int size = lineLen + (next ? 0 : tailLen);
+
+        EditorRowInsertSlot(++y, size, NULL);
+        row = EditorRowNewData(y);
+        EditorRowReserveChars(y, size);
+        memcpy(row->chars, p, lineLen);
+        if(next == NULL) memcpy(&row->chars[lineLen], tail, tailLen);
+        row->chars[size] = '\0';
+        EditorUpdateRowRender(y);
+
+        if(next == NULL){
+            *col = lineLen;
+            break;
+        }
+        p = next + 1;
+    }
+
+    free(tail);
+    EditorSyntaxInvalidateRange(first, y);
+    *at = y;
+    E.buf->dirty++;
+}
+
+// Removes text holding '\n' separated lines from (at, col), the inverse of EditorRowsInsertText
+void EditorRowsDeleteText(int at, int col, const char* text, int len){
+    const char* lastNl = memrchr(text, '\n', len);
+    if(lastNl == NULL){
+        EditorRowDelString(at, col, len);
+        return;
+    }
+
+    int lines = 0;
+    for(const char* p = text; (p = memchr(p, '\n', text + len - p)); ++p) lines++;
+
+    // Row at keeps what was before col and gets what followed the text on the last row
+    int last = at + lines;
+    int skip = text + len - lastNl - 1;
+    eRow* lastRow = EditorRowMaterialize(last);
+    int restLen = EditorRowSize(last) - skip;
+
+    EditorRowMaterialize(at);
+    EditorRowReserveChars(at, col + restLen);
+    eRow* row = EditorRowAt(at);
+    memcpy(&row->chars[col], &lastRow->chars[skip], restLen);
+    row->chars[col + restLen] = '\0';
+    EditorRowSetSize(at, col + restLen);
+
+    EditorDelRows(at + 1, lines);
+    EditorUpdateRowRender(at);
+    EditorSyntaxInvalidate(at);
+}
+
+// Every change to the text is one of these. Each type is paired with its
+// inverse, so undoing an edit is applying type ^ 1 with the same arguments.
+enum editType {
+    EDIT_INSERT = 0,     // Insert len bytes of text into row at col
+    EDIT_DELETE,         // Delete len bytes, text, from row at col
+    EDIT_SPLIT,          // Move everything from col on in row to a new row below it
+    EDIT_JOIN,           // Append the row below to row, whose length was col
+    EDIT_INSERT_ROW,     // Insert an empty row at row
+    EDIT_DELETE_ROW,     // Delete the empty row at row
+    EDIT_INSERT_TEXT,    // Insert len bytes of '\n' separated lines at row and col, a paste
+    EDIT_DELETE_TEXT     // Delete len bytes of '\n' separated lines, text, from row and col
+};
+
+// Applies an edit and leaves the cursor where it ends
+void EditorApplyEdit(int type, int at, int col, const char* text, int len){
+    JournalAppend(type, at, col, text, len);
+
+    eRow* row = at < E.buf->numRows ? EditorRowMaterialize(at) : NULL;
+
+    switch(type){
+    case EDIT_INSERT:
+        EditorRowInsertString(at, col, text, len);
+        col += len;
+        break;
+    case EDIT_DELETE:
+        EditorRowDelString(at, col, len);
+        break;
+    case EDIT_SPLIT:
+        {
+            int size = EditorRowSize(at);
+            EditorInsertRow(at + 1, &row->chars[col], size - col);
+            row->chars[col] = '\0';
+            EditorRowSetSize(at, col);
+            EditorUpdateRowSpan(at, col, size - col, 0);
+        }
+        at++;
+        col = 0;
+        break;
+    case EDIT_JOIN:
+        {
+            eRow* next = EditorRowMaterialize(at + 1);
+            EditorRowAppendString(at, next->chars, EditorRowSize(at + 1));
+            EditorDelRow(at + 1);
+        }
+        break;
+    case EDIT_INSERT_ROW:
+        EditorInsertRow(at, "", 0);
+        at++;
+        col = 0;
+        break;
+    case EDIT_DELETE_ROW:
+        EditorDelRow(at);
+        col = 0;
+        break;
+    case EDIT_INSERT_TEXT:
+        EditorRowsInsertText(&at, &col, text, len);
+        break;
+    case EDIT_DELETE_TEXT:
+        EditorRowsDeleteText(at, col, text, len);
+        break;
+    }
+
+    E.buf->curY = at;
+    E.buf->curX = col;
+}
+
+/*==== UNDO ====*/
+
+// Edits are logged as compact records packed into a list of blocks, oldest
+// first. Records are a header, the text the edit inserted or deleted, and a
+// trailing size so the log can be walked backwards. Everything before the
+// position (block, off) can be undone, everything after it redone.
+
+#define JEDITOR_UNDO_BLOCK (64 << 10)
+#define JEDITOR_UNDO_MAX (16 << 20) // Oldest blocks are dropped past this many bytes
+
+struct undoRecord {
+    int type;
+    int row;
+    int col;
+    int len;
+};
+
+struct undoBlock {
+    struct undoBlock* prev;
+    struct undoBlock* next;
+    size_t used;
+    size_t cap;
+    char data[];
+};
+
+#define UNDO_TEXT(r) ((char*)((r) + 1))
+
+size_t UndoRecordSize(int len){
+    size_t size = sizeof(struct undoRecord) + len + sizeof(int);
+    return (size + sizeof(int) - 1) & ~(sizeof(int) - 1);
+}
+
+void UndoSetSize(char* start, size_t size){
+    int n = size;
+    memcpy(start + size - sizeof(int), &n, sizeof(int));
+}
+
+void UndoFreeBlocks(struct undoBlock* block){
+    while(block){
+        struct undoBlock* next = block->next;
+        E.buf->undo.bytes -= block->cap;
+        free(block);
+        block = next;
+    }
+}
+
+// Drops everything that could be redone
+void UndoTruncate(){
+    struct undoLog* u = &E.buf->undo;
+    if(u->block == NULL) return;
+
+    UndoFreeBlocks(u->block->next);
+    u->block->next = NULL;
+    u->block->used = u->off;
+    u->tail = u->block;
+}
+
+// The record ending at the position, or NULL at the start of its block
+struct undoRecord* UndoLast(){
+    struct undoLog* u = &E.buf->undo;
+    if(u->block == NULL || u->off == 0) return NULL;
+
+    int size;
+    memcpy(&size, u->block->data + u->off - sizeof(int), sizeof(int));
+    return (struct undoRecord*)(u->block->data + u->off - size);
+}
+
+// Grows the last record instead of adding one for runs of typing or deleting
+int UndoCoalesce(int type, int row, int col, const char* text, int len){
+    struct undoLog* u = &E.buf->undo;
+    struct undoRecord* r = UndoLast();
+
+    if(u->sealed || r == NULL || r->type != type || r->row != row) return 0;
+
+    int append;
+    if(type == EDIT_INSERT){
+        if(col != r->col + r->len) return 0;
+        // Each word gets its own step: break when a word starts after a space
+        if(!isspace((unsigned char)text[0]) && isspace((unsigned char)UNDO_TEXT(r)[r->len - 1])) return 0;
+        append = 1;
+    }
+    else if(type == EDIT_DELETE){
+        if(col == r->col) append = 1;             // Forward delete
+        else if(col + len == r->col) append = 0;  // Backspace
+        else return 0;
+    }
+    else return 0;
+
+    size_t start = (char*)r - u->block->data;
+    size_t size = UndoRecordSize(r->len + len);
+    if(start + size > u->block->cap) return 0;
+
+    char* dst = UNDO_TEXT(r);
+    if(append){
+        memcpy(dst + r->len, text, len);
+    }
+    else {
+        memmove(dst + len, dst, r->len);
+        memcpy(dst, text, len);
+        r->col = col;
+    }
+
+    r->len += len;
+    UndoSetSize((char*)r, size);
+    u->off = u->block->used = start + size;
+    return 1;
+}
+
+void UndoRecord(int type, int row, int col, const char* text, int len){
+    struct undoLog* u = &E.buf->undo;
+
+    UndoTruncate();
+    if(UndoCoalesce(type, row, col, text, len)) return;
+
+    size_t size = UndoRecordSize(len);
+    if(u->block == NULL || u->block->cap - u->block->used < size){
+        size_t cap = size > JEDITOR_UNDO_BLOCK ? size : JEDITOR_UNDO_BLOCK;
+        struct undoBlock* block = malloc(sizeof(struct undoBlock) + cap);
+        if(block == NULL) Die("malloc");
+
+        block->prev = u->tail;
+        block->next = NULL;
+        block->used = 0;
+        block->cap = cap;
+
+        if(u->tail) u->tail->next = block;
+        else u->head = block;
+        u->tail = u->block = block;
+        u->off = 0;
+        u->bytes += cap;
+
+        while(u->bytes > JEDITOR_UNDO_MAX && u->head != u->block){
+            struct undoBlock* old = u->head;
+            u->head = old->next;
+            u->head->prev = NULL;
+            old->next = NULL;
+            UndoFreeBlocks(old);
+        }
+    }
+
+    struct undoRecord* r = (struct undoRecord*)(u->block->data + u->off);
+    r->type = type;
+    r->row = row;
+    r->col = col;
+    r->len = len;
+    if(len) memcpy(UNDO_TEXT(r), text, len);
+    UndoSetSize((char*)r, size);
+
+    u->off = u->block->used = u->off + size;
+    u->sealed = 0;
+}
+
+// Ends the current run of typing so the next edit starts a new undo step
+void UndoSeal(){
+    E.buf->undo.sealed = 1;
+}
+
+void EditorUndo(){
+    struct undoLog* u = &E.buf->undo;
+
+    if(u->block && u->off == 0 && u->block->prev){
+        u->block = u->block->prev;
+        u->off = u->block->used;
+    }
+
+    struct undoRecord* r = UndoLast();
+    if(r == NULL){
+        EditorSetStatusMessage("Nothing to undo");
+        return;
+    }
+
+    EditorApplyEdit(r->type ^ 1, r->row, r->col, UNDO_TEXT(r), r->len);
+    u->off = (char*)r - u->block->data;
+    u->sealed = 1;
+}
+
+void EditorRedo(){
+    struct undoLog* u = &E.buf->undo;
+
+    if(u->block && u->off == u->block->used && u->block->next){
+        u->block = u->block->next;
+        u->off = 0;
+    }
+
+    if(u->block == NULL || u->off == u->block->used){
+        EditorSetStatusMessage("Nothing to redo");
+        return;
+    }
+
+    struct undoRecord* r = (struct undoRecord*)(u->block->data + u->off);
+    EditorApplyEdit(r->type, r->row, r->col, UNDO_TEXT(r), r->len);
+    u->off += UndoRecordSize(r->len);
+    u->sealed = 1;
+}
+
+/*==== EDITOR OPERATIONS ====*/
+
+// Followed files and stdin only change by growing, see EditorFollow
+int EditorReadOnly(){
+    if(E.buf->follow.piped) EditorSetStatusMessage("Read only while reading from stdin");
+    else if(E.buf->follow.fd != -1) EditorSetStatusMessage("Read only while following the file");
+    else return 0;
+
+    return 1;
+}
+
+// Logs an edit for undo, then applies it. Returns -1 if the buffer is read only.
+int EditorEdit(int type, int row, int col, const char* text, int len){
+    if(EditorReadOnly()) return -1;
+
+    UndoRecord(type, row, col, text, len);
+    EditorApplyEdit(type, row, col, text, len);
+    return 0;
+}
+
+void EditorInsertChar(int c){
+    if(E.buf->curY == E.buf->numRows){ // If we are on ~
+        if(EditorEdit(EDIT_INSERT_ROW, E.buf->numRows, 0, NULL, 0) == -1) return;
+        E.buf->curY--;
+    }
+
+    char ch = c;
+    EditorEdit(EDIT_INSERT, E.buf->curY, E.buf->curX, &ch, 1);
+}
+
+void EditorInsertNewline(){
+    if(E.buf->curX == 0){
+        EditorEdit(EDIT_INSERT_ROW, E.buf->curY, 0, NULL, 0);
+    }
+    else {
+        EditorEdit(EDIT_SPLIT, E.buf->curY, E.buf->curX, NULL, 0);
+    }
+}
+
+void EditorDelChar(){
+    if(E.buf->curY == E.buf->numRows) return;
+    if(E.buf->curX == 0 && E.buf->curY == 0) return;
+
+    if(E.buf->curX > 0){
+        eRow* row = EditorRowMaterialize(E.buf->curY);
+        int from = Utf8CharStart(row->chars, EditorRowSize(E.buf->curY), E.buf->curX - 1); // The whole character before the cursor
+        EditorEdit(EDIT_DELETE, E.buf->curY, from, &row->chars[from], E.buf->curX - from);
+    }
+    else {
+        EditorEdit(EDIT_JOIN, E.buf->curY - 1, EditorRowSize(E.buf->curY - 1), NULL, 0);
+    }
+}
+
+/*==== JOURNAL ====*/
+
+// Every applied edit, including undo and redo, is appended to a hidden file
+// next to the one being edited, in the undo log's record format. Records are
+// buffered and written in one go once input goes idle, a batch fills up or a
+// second has passed, then fdatasync'd together while idle. Opening a file that
+// has a journal replays it, and saving removes it. A file has one journal, so
+// only the first buffer on it keeps one.
+
+#define JOURNAL_MAGIC "JEDJRNL1"
+
+struct journalHeader {
+    char magic[8];
+    int64_t baseSize;
+    int64_t baseSec;
+    int64_t baseNsec;
+};
+
+char* JournalPath(const char* file){
+    char* path = realpath(file, NULL);
+    if(path == NULL) path = strdup(file);
+
+    char* slash = strrchr(path, '/');
+    int dirLen = slash ? slash - path + 1 : 0;
+
+    char* jpath = malloc(strlen(path) + 16);
+    sprintf(jpath, "%.*s.%s.journal", dirLen, path, path + dirLen);
+    free(path);
+
+    return jpath;
+}
+
+void JournalSetBase(struct journal* j, struct stat* st){
+    j->baseSize = st ? st->st_size : 0;
+    j->baseSec = st ? st->st_mtim.tv_sec : 0;
+    j->baseNsec = st ? st->st_mtim.tv_nsec : 0;
+}
+
+void JournalFail(struct journal* j){
+    EditorSetStatusMessage("Journal disabled! I/O error: %s", strerror(errno));
+
+    if(j->fd != -1) close(j->fd);
+    j->fd = -1;
+    j->len = 0;
+    j->failed = 1;
+}
+
+// Whether a buffer other than the current one keeps the journal at path
+int JournalTaken(const char* path){
+    for(int b = 0; b < E.numBuffers; ++b){
+        struct journal* other = &E.buffers[b]->journal;
+        if(E.buffers[b] != E.buf && !other->shared && other->path && !strcmp(other->path, path)) return 1;
+    }
+
+    return 0;
+}
+
+int JournalCreate(){
+    struct journal* j = &E.buf->journal;
+    if(j->failed || j->shared || E.buf->filename == NULL) return -1;
+
+    free(j->path);
+    j->path = JournalPath(E.buf->filename);
+    if(JournalTaken(j->path)){
+        j->shared = 1;
+        return -1;
+    }
+
+    j->fd = open(j->path, O_RDWR | O_CREAT | O_TRUNC, 0600); // Read back by JournalRebase
+    if(j->fd == -1){
+        JournalFail(j);
+        return -1;
+    }
+
+    struct journalHeader hdr;
+    memcpy(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic));
+    hdr.baseSize = j->baseSize;
+    hdr.baseSec = j->baseSec;
+    hdr.baseNsec = j->baseNsec;
+
+    if(WriteAll(j->fd, (char*)&hdr, sizeof(hdr)) == -1){
+        JournalFail(j);
+        return -1;
+    }
+
+    return 0;
+}
+
+void JournalAppend(int type, int row, int col, const char* text, int len){
+    struct journal* j = &E.buf->journal;
+    if(j->replaying) return;
+    if(j->fd == -1 && JournalCreate() == -1) return;
+
+    struct undoRecord r = {type, row, col, len};
+    size_t need = j->len + sizeof(r) + len;
+    if(need > j->cap){
+        j->cap = need > j->cap * 2 ? need : j->cap * 2;
+        j->buf = realloc(j->buf, j->cap);
+        if(j->buf == NULL) Die("realloc");
+    }
+
+    if(j->len == 0) j->oldest = time(NULL);
+
+    memcpy(j->buf + j->len, &r, sizeof(r));
+    if(len) memcpy(j->buf + j->len + sizeof(r), text, len);
+    j->len = need;
+
+    if(j->len >= JEDITOR_JOURNAL_BATCH || time(NULL) - j->oldest >= 1) JournalCommit(j, 0);
+}
+
+// Writes out buffered records, and makes everything written durable if sync is set
+void JournalCommit(struct journal* j, int sync){
+    if(j->fd == -1) return;
+
+    if(j->len){
+        if(WriteAll(j->fd, j->buf, j->len) == -1){
+            JournalFail(j);
+            return;
+        }
+
+        j->len = 0;
+        j->unsynced = 1;
+    }
+
+    if(sync && j->unsynced){
+        if(fdatasync(j->fd) == -1){
+            JournalFail(j);
+            return;
+        }
+
+        j->unsynced = 0;
+    }
+}
+
+// Drops the journal once its edits are in the file itself, whose new state is st
+void JournalDiscard(struct journal* j, struct stat* st){
+
+    if(j->fd != -1){
+        close(j->fd);
+        unlink(j->path);
+    }
+
+    j->fd = -1;
+    j->len = 0;
+    j->unsynced = 0;
+    if(st) JournalSetBase(j, st);
+}
+
+// Starts the journal over for the file just saved, whose state is st. Records
+// from offset from on were added while it was being saved, so they are kept.
+void JournalRebase(struct journal* j, off_t from, struct stat* st){
+    JournalCommit(j, 0);
+
+    char* tail = NULL;
+    size_t tailLen = 0;
+    off_t end = j->fd != -1 ? lseek(j->fd, 0, SEEK_END) : -1;
+    if(end > from){
+        tailLen = end - from;
+        tail = malloc(tailLen);
+        if(tail == NULL) Die("malloc");
+
+        size_t got = 0;
+        while(got < tailLen){
+            ssize_t n = pread(j->fd, tail + got, tailLen - got, from + got);
+            if(n == -1 && errno == EINTR) continue;
+            if(n <= 0){
+                if(n == 0) errno = EIO;
+                free(tail);
+                JournalFail(j);
+                return;
+            }
+            got += n;
+        }
+    }
+
+    JournalDiscard(j, st);
+
+    if(tailLen && JournalCreate() == 0){
+        if(WriteAll(j->fd, tail, tailLen) == -1) JournalFail(j);
+        else j->unsynced = 1;
+    }
+    free(tail);
+}
+
+// Lets go of the journal when its buffer goes away. The edits in it are thrown
+// away with the buffer, unless the last save failed and they are all there is.
+void JournalClose(struct journal* j){
+    if(!j->keep){
+        JournalDiscard(j, NULL);
+        return;
+    }
+
+    JournalCommit(j, 1);
+    if(j->fd != -1) close(j->fd);
+    j->fd = -1;
+    j->len = 0;
+}
+
+// Whether an edit read back from a journal, with its text, fits the rows it would apply to
+int JournalEditValid(struct undoRecord* r, const char* text){
+    if(r->row < 0 || r->col < 0 || r->len < 0) return 0;
+    if(r->type == EDIT_INSERT_ROW) return r->row <= E.buf->numRows;
+    if(r->row >= E.buf->numRows) return 0;
+
+    int size = EditorRowSize(r->row);
+    switch(r->type){
+    case EDIT_INSERT:     return r->col <= size;
+    case EDIT_DELETE:     return r->col + r->len <= size;
+    case EDIT_SPLIT:      return r->col <= size;
+    case EDIT_JOIN:       return r->col == size && r->row + 1 < E.buf->numRows;
+    case EDIT_DELETE_ROW: return size == 0;
+    case EDIT_INSERT_TEXT: return r->col <= size;
+    case EDIT_DELETE_TEXT:
+        {
+            const char* nl = memchr(text, '\n', r->len);
+            if(nl == NULL) return r->col + r->len <= size;
+            if(r->col + (nl - text) != size) return 0;
+
+            int row = r->row;
+            const char* p = nl + 1;
+            while((nl = memchr(p, '\n', text + r->len - p))){
+                if(++row >= E.buf->numRows || EditorRowSize(row) != nl - p) return 0;
+                p = nl + 1;
+            }
+            return ++row < E.buf->numRows && EditorRowSize(row) >= text + r->len - p;
+        }
+    }
+
+    return 0;
+}
+
+// Replays the journal left behind for the file just opened, whose state is st
+void JournalRecover(struct stat* st){
+    struct journal* j = &E.buf->journal;
+    JournalSetBase(j, st);
+
+    free(j->path);
+    j->path = JournalPath(E.buf->filename);
+    j->shared = JournalTaken(j->path);
+    if(j->shared) return; // Its edits belong to the other buffer
+
+    int fd = open(j->path, O_RDWR);
+    if(fd == -1) return;
+
+    struct stat jst;
+    struct journalHeader hdr;
+    char* data = NULL;
+    if(fstat(fd, &jst) == -1 || jst.st_size < (off_t)sizeof(hdr)) goto ignore;
+
+    data = malloc(jst.st_size);
+    if(data == NULL) Die("malloc");
+
+    size_t got = 0;
+    while(got < (size_t)jst.st_size){
+        ssize_t n = read(fd, data + got, jst.st_size - got);
+        if(n == -1 && errno == EINTR) continue;
+        if(n <= 0) goto ignore;
+        got += n;
+    }
+
+    memcpy(&hdr, data, sizeof(hdr));
+    if(memcmp(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic)) || hdr.baseSize != j->baseSize ||
+       hdr.baseSec != j->baseSec || hdr.baseNsec != j->baseNsec){
+        // Kept aside, the next edit would start a fresh journal over it
+        char* old = malloc(strlen(j->path) + 5);
+        if(old == NULL) Die("malloc");
+        sprintf(old, "%s.old", j->path);
+
+        if(rename(j->path, old) == 0){
+            EditorSetStatusMessage("Journal for another version of the file not replayed, moved to %s", old);
+        }
+        else {
+            EditorSetStatusMessage("Journal %s is for another version of the file, not replayed or overwritten", j->path);
+            j->failed = 1;
+        }
+
+        free(old);
+        goto ignore;
+    }
+
+    size_t off = sizeof(hdr);
+    int count = 0;
+    j->replaying = 1;
+
+    while(off + sizeof(struct undoRecord) <= got){ // A torn last record is dropped
+        struct undoRecord r;
+        memcpy(&r, data + off, sizeof(r));
+        if(r.len < 0 || off + sizeof(r) + r.len > got) break;
+        if(!JournalEditValid(&r, data + off + sizeof(r))) break;
+
+        EditorEdit(r.type, r.row, r.col, data + off + sizeof(r), r.len);
+        off += sizeof(r) + r.len;
+        count++;
+    }
+
+    j->replaying = 0;
+    free(data);
+
+    if(ftruncate(fd, off) == -1 || lseek(fd, 0, SEEK_END) == -1){
+        close(fd);
+        return;
+    }
+
+    j->fd = fd; // Later edits are appended to it
+    UndoSeal();
+    if(count) EditorSetStatusMessage("Recovered %d edits from %s", count, j->path);
+    return;
+
+ignore:
+    free(data);
+    close(fd);
+}
+
+/*==== WORKERS ====*/
+
+// How many threads to split work over so each gets at least minPerWorker of it
+int WorkerCount(size_t work, size_t minPerWorker){
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t count = work / minPerWorker;
+
+    if(cpus > 0 && count > (size_t)cpus) count = cpus;
+    if(count > JEDITOR_MAX_THREADS) count = JEDITOR_MAX_THREADS;
+    if(count < 1) count = 1;
+
+    return count;
+}
+
+/*==== LINE INDEX ====*/
+
+// Finds every line of a mapped file. The file is split into chunks that are
+// scanned on their own threads with the widest newline search the cpu supports,
+// each recording where its lines end with any '\r' before the '\n' left out.
+
+struct lineChunk {
+    const char* base;
+    size_t from;
+    size_t to;
+    size_t* end;  // Line end, trailing '\r's excluded
+    size_t* next; // Offset just past the '\n'
+    int count;
+    int cap;
+};
+
+static void LineChunkPush(struct lineChunk* lc, size_t nl){
+    if(lc->count == lc->cap){
+        lc->cap = lc->cap ? lc->cap * 2 : 4096;
+        lc->end = realloc(lc->end, sizeof(size_t) * lc->cap);
+        lc->next = realloc(lc->next, sizeof(size_t) * lc->cap);
+        if(lc->end == NULL || lc->next == NULL) Die("realloc");
+    }
+
+    size_t end = nl;
+    while(end > 0 && lc->base[end - 1] == '\r') end--; // Stops at the previous '\n' at the latest
+
+    lc->end[lc->count] = end;
+    lc->next[lc->count] = nl + 1;
+    lc->count++;
+}
+
+static void LineIndexScalar(struct lineChunk* lc){
+    const char* ptr = lc->base + lc->from;
+    const char* end = lc->base + lc->to;
+
+    while((ptr = memchr(ptr, '\n', end - ptr)) != NULL){
+        LineChunkPush(lc, ptr - lc->base);
+        ptr++;
+    }
+}
+
+#ifdef JEDITOR_X86
+__attribute__((target("sse2")))
+static void LineIndexSSE2(struct lineChunk* lc){
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t i = lc->from;
+
+    for(; i + 16 <= lc->to; i += 16){
+        __m128i block = _mm_loadu_si128((const __m128i*)(lc->base + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, nl));
+
+        while(mask){
+            LineChunkPush(lc, i + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+
+    for(; i < lc->to; ++i){
+        if(lc->base[i] == '\n') LineChunkPush(lc, i);
+    }
+}
+
+__attribute__((target("avx2")))
+static void LineIndexAVX2(struct lineChunk* lc){
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = lc->from;
+
+    for(; i + 32 <= lc->to; i += 32){
+        __m256i block = _mm256_loadu_si256((const __m256i*)(lc->base + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, nl));
+
+        while(mask){
+            LineChunkPush(lc, i + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+
+    for(; i < lc->to; ++i){
+        if(lc->base[i] == '\n') LineChunkPush(lc, i);
+    }
+}
+#endif
+
+static void (*LineIndexKernel)(struct lineChunk*) = NULL;
+
+void LineIndexSelectKernel(){
+    LineIndexKernel = LineIndexScalar;
+
+#ifdef JEDITOR_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) LineIndexKernel = LineIndexAVX2;
+    else if(__builtin_cpu_supports("sse2")) LineIndexKernel = LineIndexSSE2;
+#endif
+}
+
+static void* LineIndexWorker(void* arg){
+    LineIndexKernel(arg);
+    return NULL;
+}
+
+// Fills chunks[0..return) covering map, chunks are in file order
+int LineIndexBuild(const char* map, size_t len, struct lineChunk* chunks){
+    if(LineIndexKernel == NULL) LineIndexSelectKernel();
+
+    size_t numChunks = WorkerCount(len, JEDITOR_INDEX_MIN_CHUNK);
+
+    pthread_t threads[JEDITOR_MAX_THREADS];
+    size_t from = 0;
+
+    for(size_t j = 0; j < numChunks; ++j){
+        struct lineChunk* lc = &chunks[j];
+        memset(lc, 0, sizeof(*lc));
+        lc->base = map;
+        lc->from = from;
+        lc->to = (j == numChunks - 1) ? len : len / numChunks * (j + 1);
+        from = lc->to;
+
+        if(j > 0 && pthread_create(&threads[j], NULL, LineIndexWorker, lc) != 0){
+            Die("pthread_create");
+        }
+    }
+
+    LineIndexKernel(&chunks[0]);
+
+    for(size_t j = 1; j < numChunks; ++j){
+        pthread_join(threads[j], NULL);
+    }
+
+    return numChunks;
+}
+
+/*==== FILE I/O ====*/
+
+// Mappings are shared by every buffer showing the same version of a file, so
+// opening a large file twice does not map or page it in twice. Rows only ever
+// read from a mapping, edited rows get their own copy.
+
+struct sharedMap {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    char* addr;
+    size_t len;
+    int refs;
+    struct sharedMap* next;
+};
+
+struct sharedMap* sharedMaps = NULL;
+
+struct sharedMap* SharedMapOpen(int fd, struct stat* st){
+    struct sharedMap* sm;
+
+    for(sm = sharedMaps; sm; sm = sm->next){
+        if(sm->dev == st->st_dev && sm->ino == st->st_ino && sm->size == st->st_size &&
+           sm->mtime.tv_sec == st->st_mtim.tv_sec && sm->mtime.tv_nsec == st->st_mtim.tv_nsec){
+            sm->refs++;
+            return sm;
+        }
+    }
+
+    char* addr = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(addr == MAP_FAILED) return NULL;
+
+    sm = malloc(sizeof(*sm));
+    if(sm == NULL) Die("malloc");
+
+    sm->dev = st->st_dev;
+    sm->ino = st->st_ino;
+    sm->size = st->st_size;
+    sm->mtime = st->st_mtim;
+    sm->addr = addr;
+    sm->len = st->st_size;
+    sm->refs = 1;
+    sm->next = sharedMaps;
+    sharedMaps = sm;
+
+    return sm;
+}
+
+void SharedMapRelease(struct sharedMap* sm){
+    if(sm == NULL || --sm->refs > 0) return;
+
+    struct sharedMap** link = &sharedMaps;
+    while(*link != sm) link = &(*link)->next;
+    *link = sm->next;
+
+    munmap(sm->addr, sm->len);
+    free(sm);
+}
+
+// Only indexes line boundaries, rows are materialized as they come into view
+void EditorOpenMapped(struct sharedMap* sm){
+    E.buf->map = sm;
+    char* map = sm->addr;
+    size_t len = sm->len;
+
+    struct lineChunk chunks[JEDITOR_MAX_THREADS];
+    int numChunks = LineIndexBuild(map, len, chunks);
+
+    int total = 1; // A last line without a '\n'
+    for(int j = 0; j < numChunks; ++j) total += chunks[j].count;
+    EditorRowReserve(total);
+
+    size_t start = 0;
+    for(int j = 0; j < numChunks; ++j){
+        struct lineChunk* lc = &chunks[j];
+
+        for(int k = 0; k < lc->count; ++k){
+            EditorInsertMappedRow(E.buf->numRows, map + start, lc->end[k] - start);
+            start = lc->next[k];
+        }
+
+        free(lc->end);
+        free(lc->next);
+    }
+
+    if(start < len){
+        size_t end = len;
+        while(end > start && map[end - 1] == '\r') end--;
+        EditorInsertMappedRow(E.buf->numRows, map + start, end - start);
+    }
+}
+
+// Loads file into the current buffer. Returns -1 with errno set if it cannot be opened.
+int EditorOpen(char* file){
+    int fd = open(file, O_RDONLY);
+    if(fd == -1) return -1;
+
+    struct stat st;
+    if(fstat(fd, &st) == -1) Die("fstat");
+
+    EditorFreeRows();
+
+    free(E.buf->filename);
+    E.buf->filename = strdup(file);
+
+    EditorSelectSyntaxHighlight();
+
+    if(S_ISREG(st.st_mode) && st.st_size > 0){
+        struct sharedMap* sm = SharedMapOpen(fd, &st);
+        if(sm){
+            close(fd);
+            EditorOpenMapped(sm);
+            E.buf->dirty = 0;
+            JournalRecover(&st);
+            return 0;
+        }
+    }
+
+    FILE* fptr = fdopen(fd, "r"); // Fall back to reading pipes and such line by line
+    if(!fptr) Die("fdopen");
+
+    char* line = NULL;
+    size_t lineCap = 0;
+    ssize_t lineLen;
+
+    while((lineLen = getline(&line, &lineCap, fptr)) != -1){
+        while(lineLen > 0 && (line[lineLen - 1] == '\n' || line[lineLen - 1] == '\r')){
+            lineLen--;
+        }
+        EditorInsertMappedRow(E.buf->numRows, RowMemCopyText(&E.buf->mem, line, lineLen), lineLen);
+    }
+
+    free(line);
+    fclose(fptr);
+    E.buf->dirty = 0;
+    JournalRecover(&st);
+    return 0;
+}
+
+// Saving streams the rows into a temporary file next to the target. Once they
+// are written the buffer counts as saved, and a background thread fsyncs the
+// file and renames it over the target so the UI does not wait on the disk.
+// The old file stays intact until the rename, and stays readable by the
+// mapping rows may still point into after it.
+
+struct saveJob {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int pending; // Started and not reaped yet
+    int done;
+    int err;     // errno of the step that failed, 0 on success
+    int fd;
+    char* tmpPath;
+    char* path;
+    char* dirPath;
+    size_t bytes;
+    struct editorBuffer* buf;
+    struct stat saved;     // The temporary file, which becomes the target
+    int savedValid;
+    off_t journalFrom;     // Where the buffer's journal records made after the save start
+};
+
+struct saveJob saveJob = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Writes all of iov, retrying short writes and interrupted calls
+int WriteVAll(int fd, struct iovec* iov, int count){
+    while(count > 0){
+        ssize_t n = writev(fd, iov, count);
+
+        if(n == -1){
+            if(errno == EINTR) continue;
+            return -1;
+        }
+
+        while(count > 0 && (size_t)n >= iov->iov_len){
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+
+        if(count > 0){
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+int EditorWriteRows(int fd, size_t* written){
+    struct iovec iov[JEDITOR_SAVE_BATCH * 2];
+    int n = 0;
+
+    *written = 0;
+    for(int j = 0; j < E.buf->numRows; ++j){
+        int size = EditorRowSize(j);
+
+        iov[n].iov_base = (void*)EditorRowText(j);
+        iov[n++].iov_len = size;
+        iov[n].iov_base = "\n";
+        iov[n++].iov_len = 1;
+        *written += size + 1;
+
+        if(n == JEDITOR_SAVE_BATCH * 2 || j == E.buf->numRows - 1){
+            if(WriteVAll(fd, iov, n) == -1) return -1;
+            n = 0;
+        }
+    }
+
+    return 0;
+}
+
+static void* EditorSaveCommit(void* arg){
+    struct saveJob* job = arg;
+    int err = 0;
+
+    if(fsync(job->fd) == -1) err = errno;
+    if(close(job->fd) == -1 && !err) err = errno;
+    if(!err && rename(job->tmpPath, job->path) == -1) err = errno;
+
+    if(err){
+        unlink(job->tmpPath);
+    }
+    else {
+        int dirFd = open(job->dirPath, O_RDONLY); // Makes the rename itself durable
+        if(dirFd != -1){
+            fsync(dirFd);
+            close(dirFd);
+        }
+    }
+
+    pthread_mutex_lock(&job->lock);
+    job->err = err;
+    job->done = 1;
+    pthread_mutex_unlock(&job->lock);
+    EditorWake();
+
+    return NULL;
+}
+
+void EditorSaveFinish(struct saveJob* job){
+    if(job->err){
+        job->buf->dirty++;
+        job->buf->journal.keep = 1;
+        EditorSetStatusMessage("Cannot save! I/O error: %s", strerror(job->err));
+    }
+    else {
+        struct editorBuffer* current = E.buf;
+        E.buf = job->buf;
+        JournalRebase(&E.buf->journal, job->journalFrom, job->savedValid ? &job->saved : NULL);
+        E.buf->journal.keep = 0;
+        E.buf = current;
+
+        EditorSetStatusMessage("%zu bytes written to disk", job->bytes);
+    }
+
+    free(job->tmpPath);
+    free(job->path);
+    free(job->dirPath);
+}
+
+// Reports a finished save, waiting for it first if wait is set. Returns
+// whether there was one to report.
+int EditorSaveReap(int wait){
+    struct saveJob* job = &saveJob;
+    if(!job->pending) return 0;
+
+    pthread_mutex_lock(&job->lock);
+    int done = job->done;
+    pthread_mutex_unlock(&job->lock);
+
+    if(!done && !wait) return 0;
+
+    pthread_join(job->thread, NULL);
+    job->pending = 0;
+    EditorSaveFinish(job);
+    return 1;
+}
+
+void EditorSave(){
+    if(EditorReadOnly()) return;
+
+    if(E.buf->filename == NULL){
+        E.buf->filename = EditorPrompt("Save as: %s", NULL);
+        if(E.buf->filename == NULL){
+            EditorSetStatusMessage("Save aborted!");
+            return;
+        }
+
+        EditorSelectSyntaxHighlight();
+    }
+
+    EditorSaveReap(1);
+
+    struct saveJob* job = &saveJob;
+    job->path = realpath(E.buf->filename, NULL); // Replace the file a symlink points to, not the link
+    if(job->path == NULL) job->path = strdup(E.buf->filename);
+
+    char* slash = strrchr(job->path, '/');
+    int dirLen = slash ? slash - job->path : 0;
+    char* base = slash ? slash + 1 : job->path;
+
+    job->dirPath = slash ? strndup(job->path, dirLen ? dirLen : 1) : strdup(".");
+    job->tmpPath = malloc(dirLen + strlen(base) + 16);
+    sprintf(job->tmpPath, "%.*s%s.%s.XXXXXX", dirLen, job->path, slash ? "/" : "", base);
+
+    struct stat st;
+    mode_t mode = 0644; // 0644 is standard permission for owner to read write
+    if(stat(job->path, &st) == 0){
+        mode = st.st_mode & 07777;
+    }
+    else {
+        mode_t mask = umask(0);
+        umask(mask);
+        mode &= ~mask;
+    }
+
+    job->fd = mkstemp(job->tmpPath);
+    if(job->fd == -1 || fchmod(job->fd, mode) == -1 || EditorWriteRows(job->fd, &job->bytes) == -1){
+        EditorSetStatusMessage("Cannot save! I/O error: %s", strerror(errno));
+        if(job->fd != -1){
+            close(job->fd);
+            unlink(job->tmpPath);
+        }
+
+        free(job->tmpPath);
+        free(job->path);
+        free(job->dirPath);
+        return;
+    }
+
+    // The journal stays until the file is renamed into place, edits made meanwhile are added to it
+    struct journal* j = &E.buf->journal;
+    JournalCommit(j, 0);
+    job->journalFrom = j->fd != -1 ? lseek(j->fd, 0, SEEK_CUR) : (off_t)sizeof(struct journalHeader);
+    job->savedValid = fstat(job->fd, &job->saved) == 0;
+
+    E.buf->dirty = 0;
+    job->buf = E.buf;
+    job->done = 0;
+    job->err = 0;
+    job->pending = 1;
+
+    if(pthread_create(&job->thread, NULL, EditorSaveCommit, job) != 0){
+        job->pending = 0;
+        EditorSaveCommit(job);
+        EditorSaveFinish(job);
+        return;
+    }
+
+    EditorSetStatusMessage("Saving %zu bytes...", job->bytes);
+}
+
+/*==== REGEX ====*/
+
+// Regular expressions for the find prompt. A pattern is parsed into a syntax
+// tree and compiled into two Thompson NFAs, one as written and one reversed.
+// Both are run through DFAs whose states are only built the first time a
+// transition is taken, so a row is matched without ever backtracking.
+// Supports . [] [^] * + ? | () ^ $ and the \d \w \s escapes.
+
+enum reNodeType {
+    RE_EMPTY = 0,
+    RE_SET,
+    RE_CAT,
+    RE_ALT,
+    RE_STAR,
+    RE_PLUS,
+    RE_QUEST,
+    RE_BOL,
+    RE_EOL
+};
+
+struct reNode {
+    int type;
+    int left, right;
+    unsigned char set[32]; // Bytes matched by RE_SET
+};
+
+struct reParser {
+    const char* p;
+    struct reNode* nodes;
+    int count;
+    int cap;
+    int error;
+};
+
+enum reStateType {
+    NFA_SET = 0,
+    NFA_SPLIT,
+    NFA_BOL,
+    NFA_EOL,
+    NFA_MATCH
+};
+
+struct reState {
+    int type;
+    int out, out1;
+    unsigned char set[32];
+};
+
+struct reProgram {
+    struct reState* states;
+    int count;
+    int cap;
+    int start;         // Matches starting right here
+    int unanchored;    // Matches starting here or anywhere after
+};
+
+struct regex {
+    struct reProgram forward;
+    struct reProgram reverse;
+};
+
+static void ReSetAdd(unsigned char* set, int c){
+    set[(unsigned char)c >> 3] |= 1 << (c & 7);
+}
+
+static int ReSetHas(const unsigned char* set, int c){
+    return set[(unsigned char)c >> 3] & (1 << (c & 7));
+}
+
+static void ReSetEscape(unsigned char* set, int c){
+    int negate = isupper(c);
+
+    unsigned char tmp[32] = {0};
+    for(int b = 0; b < 256; ++b){
+        int in;
+        switch(tolower(c)){
+        case 'd': in = isdigit(b); break;
+        case 'w': in = isalnum(b) || b == '_'; break;
+        case 's': in = isspace(b); break;
+        default: in = (b == c); negate = 0; break;
+        }
+        if(in) ReSetAdd(tmp, b);
+    }
+
+    for(int j = 0; j < 32; ++j) set[j] |= negate ? ~tmp[j] : tmp[j];
+}
+
+static int ReNewNode(struct reParser* rp, int type, int left, int right){
+    if(rp->count == rp->cap){
+        rp->cap = rp->cap ? rp->cap * 2 : 32;
+        rp->nodes = realloc(rp->nodes, sizeof(struct reNode) * rp->cap);
+        if(rp->nodes == NULL) Die("realloc");
+    }
+
+    struct reNode* node = &rp->nodes[rp->count];
+    memset(node, 0, sizeof(*node));
+    node->type = type;
+    node->left = left;
+    node->right = right;
+
+    return rp->count++;
+}
+
+static int ReParseAlt(struct reParser* rp);
+
+static int ReParseAtom(struct reParser* rp){
+    char c = *rp->p++;
+    int node;
+
+    switch(c){
+    case '(':
+        node = ReParseAlt(rp);
+        if(*rp->p != ')'){
+            rp->error = 1;
+            return node;
+        }
+        rp->p++;
+        return node;
+    case '^':
+        return ReNewNode(rp, RE_BOL, -1, -1);
+    case '$':
+        return ReNewNode(rp, RE_EOL, -1, -1);
+    case '.':
+        node = ReNewNode(rp, RE_SET, -1, -1);
+        memset(rp->nodes[node].set, 0xff, 32);
+        return node;
+    case '[':
+        {
+            node = ReNewNode(rp, RE_SET, -1, -1);
+            unsigned char set[32] = {0};
+            int negate = (*rp->p == '^');
+            if(negate) rp->p++;
+
+            int first = 1;
+            while(*rp->p && (*rp->p != ']' || first)){
+                int lo = (unsigned char)*rp->p++;
+                first = 0;
+
+                if(lo == '\\' && *rp->p){
+                    ReSetEscape(set, (unsigned char)*rp->p++);
+                    continue;
+                }
+
+                int hi = lo;
+                if(rp->p[0] == '-' && rp->p[1] && rp->p[1] != ']'){
+                    hi = (unsigned char)rp->p[1];
+                    rp->p += 2;
+                }
+
+                for(int b = lo; b <= hi; ++b) ReSetAdd(set, b);
+            }
+
+            if(*rp->p != ']'){
+                rp->error = 1;
+                return node;
+            }
+            rp->p++;
+
+            for(int j = 0; j < 32; ++j) rp->nodes[node].set[j] = negate ? ~set[j] : set[j];
+            return node;
+        }
+    case '\\':
+        if(*rp->p == '\0'){
+            rp->error = 1;
+            return ReNewNode(rp, RE_EMPTY, -1, -1);
+        }
+        node = ReNewNode(rp, RE_SET, -1, -1);
+        ReSetEscape(rp->nodes[node].set, (unsigned char)*rp->p++);
+        return node;
+    case '*':
+    case '+':
+    case '?':
+        rp->error = 1; // Nothing to repeat
+        return ReNewNode(rp, RE_EMPTY, -1, -1);
+    default:
+        node = ReNewNode(rp, RE_SET, -1, -1);
+        ReSetAdd(rp->nodes[node].set, (unsigned char)c);
+        return node;
+    }
+}
+
+static int ReParseRepeat(struct reParser* rp){
+    int node = ReParseAtom(rp);
+
+    while(*rp->p == '*' || *rp->p == '+' || *rp->p == '?'){
+        char op = *rp->p++;
+        node = ReNewNode(rp, op == '*' ? RE_STAR : op == '+' ? RE_PLUS : RE_QUEST, node, -1);
+    }
+
+    return node;
+}
+
+static int ReParseConcat(struct reParser* rp){
+    int node = ReNewNode(rp, RE_EMPTY, -1, -1);
+
+    while(*rp->p && *rp->p != '|' && *rp->p != ')' && !rp->error){
+        node = ReNewNode(rp, RE_CAT, node, ReParseRepeat(rp));
+    }
+
+    return node;
+}
+
+static int ReParseAlt(struct reParser* rp){
+    int node = ReParseConcat(rp);
+
+    while(*rp->p == '|' && !rp->error){
+        rp->p++;
+        node = ReNewNode(rp, RE_ALT, node, ReParseConcat(rp));
+    }
+
+    return node;
+}
+
+static int ReAddState(struct reProgram* prog, int type, int out, int out1){
+    if(prog->count == prog->cap){
+        prog->cap = prog->cap ? prog->cap * 2 : 32;
+        prog->states = realloc(prog->states, sizeof(struct reState) * prog->cap);
+        if(prog->states == NULL) Die("realloc");
+    }
+
+    struct reState* st = &prog->states[prog->count];
+    memset(st, 0, sizeof(*st));
+    st->type = type;
+    st->out = out;
+    st->out1 = out1;
+
+    return prog->count++;
+}
+
+// Compiles node so that it continues into state next and returns its entry state
+static int ReCompile(struct reProgram* prog, struct reNode* nodes, int node, int next, int reversed){
+    struct reNode* n = &nodes[node];
+    int split, start;
+
+    switch(n->type){
+    case RE_SET:
+        start = ReAddState(prog, NFA_SET, next, -1);
+        memcpy(prog->states[start].set, n->set, 32);
+        return start;
+    case RE_CAT:
+        if(reversed) return ReCompile(prog, nodes, n->right, ReCompile(prog, nodes, n->left, next, reversed), reversed);
+        return ReCompile(prog, nodes, n->left, ReCompile(prog, nodes, n->right, next, reversed), reversed);
+    case RE_ALT:
+        start = ReCompile(prog, nodes, n->left, next, reversed);
+        return ReAddState(prog, NFA_SPLIT, start, ReCompile(prog, nodes, n->right, next, reversed));
+    case RE_STAR:
+        split = ReAddState(prog, NFA_SPLIT, -1, next);
+        start = ReCompile(prog, nodes, n->left, split, reversed);
+        prog->states[split].out = start;
+        return split;
+    case RE_PLUS:
+        split = ReAddState(prog, NFA_SPLIT, -1, next);
+        start = ReCompile(prog, nodes, n->left, split, reversed);
+        prog->states[split].out = start;
+        return start;
+    case RE_QUEST:
+        start = ReCompile(prog, nodes, n->left, next, reversed);
+        return ReAddState(prog, NFA_SPLIT, start, next);
+    case RE_BOL:
+        return ReAddState(prog, reversed ? NFA_EOL : NFA_BOL, next, -1);
+    case RE_EOL:
+        return ReAddState(prog, reversed ? NFA_BOL : NFA_EOL, next, -1);
+    default:
+        return next;
+    }
+}
+
+static void ReBuildProgram(struct reProgram* prog, struct reNode* nodes, int root, int reversed){
+    memset(prog, 0, sizeof(*prog));
+
+    int match = ReAddState(prog, NFA_MATCH, -1, -1);
+    prog->start = ReCompile(prog, nodes, root, match, reversed);
+
+    // Skipping any byte and trying again lets a match start anywhere
+    prog->unanchored = ReAddState(prog, NFA_SPLIT, prog->start, -1);
+    int any = ReAddState(prog, NFA_SET, prog->unanchored, -1);
+    memset(prog->states[any].set, 0xff, 32);
+    prog->states[prog->unanchored].out1 = any;
+}
+
+struct regex* RegexCompile(const char* pattern){
+    struct reParser rp = {pattern, NULL, 0, 0, 0};
+    int root = ReParseAlt(&rp);
+    if(*rp.p != '\0') rp.error = 1;
+
+    if(rp.error){
+        free(rp.nodes);
+        return NULL;
+    }
+
+    struct regex* re = malloc(sizeof(struct regex));
+    if(re == NULL) Die("malloc");
+
+    ReBuildProgram(&re->forward, rp.nodes, root, 0);
+    ReBuildProgram(&re->reverse, rp.nodes, root, 1);
+
+    free(rp.nodes);
+    return re;
+}
+
+void RegexFree(struct regex* re){
+    if(re == NULL) return;
+
+    free(re->forward.states);
+    free(re->reverse.states);
+    free(re);
+}
+
+/*==== LAZY DFA ====*/
+
+// A DFA state is the set of NFA states the program can be in. Transitions are
+// filled in the first time they are taken, and the whole cache is thrown away
+// if a pattern ever needs more than JEDITOR_DFA_MAX_STATES of them.
+
+#define JEDITOR_DFA_MAX_STATES 2048
+#define DFA_UNKNOWN -1
+
+struct dfaState {
+    int* set; // Sorted NFA state indices
+    int n;
+    int match;    // set holds NFA_MATCH
+    int eolMatch; // Would match if the row ended here, DFA_UNKNOWN until needed
+    int next[256];
+};
+
+struct dfa {
+    struct reProgram* prog;
+    struct dfaState* states;
+    int count;
+    int* table; // Open addressing hash of state indices, -1 for empty
+    int tableCap;
+    int generation; // Bumped whenever the cache is cleared
+    int startCache[2][2]; // [unanchored][at beginning of line]
+    int* stack;
+    int* mark;
+    int markGen;
+    int* work;
+    int* seeds;
+};
+
+static void DfaClearStates(struct dfa* d){
+    for(int j = 0; j < d->count; ++j) free(d->states[j].set);
+    d->count = 0;
+    d->generation++;
+
+    for(int j = 0; j < d->tableCap; ++j) d->table[j] = -1;
+    for(int j = 0; j < 4; ++j) d->startCache[j / 2][j % 2] = -1;
+}
+
+void DfaInit(struct dfa* d, struct reProgram* prog){
+    memset(d, 0, sizeof(*d));
+    d->prog = prog;
+    d->states = malloc(sizeof(struct dfaState) * JEDITOR_DFA_MAX_STATES);
+    d->tableCap = JEDITOR_DFA_MAX_STATES * 2;
+    d->table = malloc(sizeof(int) * d->tableCap);
+    d->stack = malloc(sizeof(int) * prog->count * 3);
+    d->mark = calloc(prog->count, sizeof(int));
+    d->work = malloc(sizeof(int) * prog->count);
+    d->seeds = malloc(sizeof(int) * prog->count);
+    if(!d->states || !d->table || !d->stack || !d->mark || !d->work || !d->seeds) Die("malloc");
+
+    DfaClearStates(d);
+}
+
+// Points d at prog, keeping the states built so far if same is set: prog was
+// compiled from the same pattern as the one they were built for. Otherwise
+// they are cleared, but the allocations are kept.
+void DfaReuse(struct dfa* d, struct reProgram* prog, int same){
+    if(d->states == NULL){
+        DfaInit(d, prog);
+        return;
+    }
+
+    if(!same){
+        free(d->stack);
+        free(d->mark);
+        free(d->work);
+        free(d->seeds);
+        d->stack = malloc(sizeof(int) * prog->count * 3);
+        d->mark = calloc(prog->count, sizeof(int));
+        d->work = malloc(sizeof(int) * prog->count);
+        d->seeds = malloc(sizeof(int) * prog->count);
+        if(!d->stack || !d->mark || !d->work || !d->seeds) Die("malloc");
+
+        d->markGen = 0;
+        DfaClearStates(d);
+    }
+
+    d->prog = prog;
+}
+
+void DfaFree(struct dfa* d){
+    DfaClearStates(d);
+    free(d->states);
+    free(d->table);
+    free(d->stack);
+    free(d->mark);
+    free(d->work);
+    free(d->seeds);
+}
+
+static int DfaIntCompare(const void* a, const void* b){
+    return *(const int*)a - *(const int*)b;
+}
+
+// Follows every empty transition from seeds and leaves the sorted result in
+// d->work. Assertions are passed only when they hold, an unpassed $ is kept so
+// DfaEolMatch can pass it later.
+static int DfaClosure(struct dfa* d, const int* seeds, int numSeeds, int atBol, int atEol){
+    int top = 0;
+    int n = 0;
+
+    d->markGen++;
+    for(int j = 0; j < numSeeds; ++j) d->stack[top++] = seeds[j];
+
+    while(top > 0){
+        int s = d->stack[--top];
+        if(s < 0 || d->mark[s] == d->markGen) continue;
+        d->mark[s] = d->markGen;
+
+        struct reState* st = &d->prog->states[s];
+        switch(st->type){
+        case NFA_SPLIT:
+            d->stack[top++] = st->out;
+            d->stack[top++] = st->out1;
+            break;
+        case NFA_BOL:
+            if(atBol) d->stack[top++] = st->out;
+            break;
+        case NFA_EOL:
+            if(atEol) d->stack[top++] = st->out;
+            else d->work[n++] = s;
+            break;
+        default:
+            d->work[n++] = s;
+            break;
+        }
+    }
+
+    qsort(d->work, n, sizeof(int), DfaIntCompare);
+    return n;
+}
+
+static unsigned int DfaHash(const int* set, int n){
+    unsigned int h = 2166136261u;
+    for(int j = 0; j < n; ++j) h = (h ^ set[j]) * 16777619u;
+    return h;
+}
+
+// Returns the state for the set in d->work, adding it if it is new
+static int DfaLookup(struct dfa* d, int n){
+    unsigned int mask = d->tableCap - 1;
+    unsigned int h = DfaHash(d->work, n) & mask;
+
+    while(d->table[h] != -1){
+        struct dfaState* st = &d->states[d->table[h]];
+        if(st->n == n && !memcmp(st->set, d->work, sizeof(int) * n)) return d->table[h];
+        h = (h + 1) & mask;
+    }
+
+    if(d->count == JEDITOR_DFA_MAX_STATES){
+        int* saved = malloc(sizeof(int) * (n ? n : 1));
+        if(saved == NULL) Die("malloc");
+        memcpy(saved, d->work, sizeof(int) * n);
+
+        DfaClearStates(d);
+        memcpy(d->work, saved, sizeof(int) * n);
+        free(saved);
+
+        h = DfaHash(d->work, n) & mask;
+    }
+
+    int id = d->count++;
+    struct dfaState* st = &d->states[id];
+    st->n = n;
+    st->set = malloc(sizeof(int) * (n ? n : 1));
+    if(st->set == NULL) Die("malloc");
+    memcpy(st->set, d->work, sizeof(int) * n);
+
+    st->match = 0;
+    for(int j = 0; j < n; ++j){
+        if(d->prog->states[st->set[j]].type == NFA_MATCH) st->match = 1;
+    }
+
+    st->eolMatch = DFA_UNKNOWN;
+    for(int c = 0; c < 256; ++c) st->next[c] = DFA_UNKNOWN;
+
+    d->table[h] = id;
+    return id;
+}
+
+int DfaStart(struct dfa* d, int unanchored, int atBol){
+    int* cached = &d->startCache[unanchored][atBol];
+
+    if(*cached == -1){
+        int seed = unanchored ? d->prog->unanchored : d->prog->start;
+        *cached = DfaLookup(d, DfaClosure(d, &seed, 1, atBol, 0));
+    }
+
+    return *cached;
+}
+
+int DfaNext(struct dfa* d, int state, unsigned char c){
+    struct dfaState* st = &d->states[state];
+    if(st->next[c] != DFA_UNKNOWN) return st->next[c];
+
+    int numSeeds = 0;
+    for(int j = 0; j < st->n; ++j){
+        struct reState* nfa = &d->prog->states[st->set[j]];
+        if(nfa->type == NFA_SET && ReSetHas(nfa->set, c)) d->seeds[numSeeds++] = nfa->out;
+    }
+
+    int generation = d->generation;
+    int next = DfaLookup(d, DfaClosure(d, d->seeds, numSeeds, 0, 0));
+
+    if(d->generation == generation) d->states[state].next[c] = next; // Otherwise state went with the cache
+
+    return next;
+}
+
+int DfaEolMatch(struct dfa* d, int state){
+    struct dfaState* st = &d->states[state];
+
+    if(st->eolMatch == DFA_UNKNOWN){
+        int n = DfaClosure(d, st->set, st->n, 0, 1);
+        st->eolMatch = 0;
+        for(int j = 0; j < n; ++j){
+            if(d->prog->states[d->work[j]].type == NFA_MATCH) st->eolMatch = 1;
+        }
+    }
+
+    return st->eolMatch;
+}
+
+int DfaDead(struct dfa* d, int state){
+    return d->states[state].n == 0;
+}
+
+/*==== SEARCH ====*/
+
+// Collects every position of a literal query or regex in the row store. Rows
+// are split over worker threads. For a literal each row is scanned for blocks
+// where both the first and the last byte of the query line up and only those
+// are compared in full. When the query only grew since the last search the
+// previous matches are filtered instead of scanning again.
+
+struct searchWork {
+    const char* query;
+    int queryLen;
+    struct regex* re; // Used instead of query if set
+    int from; // Rows [from, to)
+    int to;
+    struct searchMatch* matches;
+    int count;
+    int cap;
+    struct dfa* forward; // Per worker since DFA states are built while matching
+    struct dfa* reverse;
+    unsigned char* starts;
+    int startsCap;
+};
+
+static void SearchPush(struct searchWork* w, int row, int col, int len){
+    if(w->count == w->cap){
+        w->cap = w->cap ? w->cap * 2 : 256;
+        w->matches = realloc(w->matches, sizeof(struct searchMatch) * w->cap);
+        if(w->matches == NULL) Die("realloc");
+    }
+
+    w->matches[w->count].row = row;
+    w->matches[w->count].col = col;
+    w->matches[w->count].len = len;
+    w->count++;
+}
+
+static void SearchRowScalar(struct searchWork* w, int row, const char* text, int len){
+    const char* q = w->query;
+    int m = w->queryLen;
+    if(len < m) return;
+
+    const char* ptr = text;
+    const char* end = text + len - m + 1;
+
+    while(ptr < end && (ptr = memchr(ptr, q[0], end - ptr)) != NULL){
+        if(!memcmp(ptr, q, m)) SearchPush(w, row, ptr - text, m);
+        ptr++;
+    }
+}
+
+#ifdef JEDITOR_X86
+__attribute__((target("sse2")))
+static void SearchRowSSE2(struct searchWork* w, int row, const char* text, int len){
+    const char* q = w->query;
+    int m = w->queryLen;
+    if(len < m) return;
+
+    const __m128i first = _mm_set1_epi8(q[0]);
+    const __m128i last = _mm_set1_epi8(q[m - 1]);
+    int i = 0;
+
+    for(; i + 16 <= len - m + 1; i += 16){
+        __m128i a = _mm_loadu_si128((const __m128i*)(text + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(text + i + m - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+
+        while(mask){
+            int at = i + __builtin_ctz(mask);
+            if(!memcmp(text + at, q, m)) SearchPush(w, row, at, m);
+            mask &= mask - 1;
+        }
+    }
+
+    for(; i <= len - m; ++i){
+        if(text[i] == q[0] && !memcmp(text + i, q, m)) SearchPush(w, row, i, m);
+    }
+}
+
+__attribute__((target("avx2")))
+static void SearchRowAVX2(struct searchWork* w, int row, const char* text, int len){
+    const char* q = w->query;
+    int m = w->queryLen;
+    if(len < m) return;
+
+    const __m256i first = _mm256_set1_epi8(q[0]);
+    const __m256i last = _mm256_set1_epi8(q[m - 1]);
+    int i = 0;
+
+    for(; i + 32 <= len - m + 1; i += 32){
+        __m256i a = _mm256_loadu_si256((const __m256i*)(text + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(text + i + m - 1));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+
+        while(mask){
+            int at = i + __builtin_ctz(mask);
+            if(!memcmp(text + at, q, m)) SearchPush(w, row, at, m);
+            mask &= mask - 1;
+        }
+    }
+
+    for(; i <= len - m; ++i){
+        if(text[i] == q[0] && !memcmp(text + i, q, m)) SearchPush(w, row, i, m);
+    }
+}
+#endif
+
+// Finds the leftmost longest matches in a row. A forward pass rules out rows
+// without any match, a backward pass with the reversed pattern marks where
+// matches can start, and each match is then extended from its start.
+static void RegexSearchRow(struct searchWork* w, int row, const char* text, int len){
+    struct dfa* f = w->forward;
+    struct dfa* r = w->reverse;
+    const unsigned char* t = (const unsigned char*)text;
+
+    int s = DfaStart(f, 1, 1);
+    int found = f->states[s].match;
+    for(int i = 0; i < len && !found; ++i){
+        s = DfaNext(f, s, t[i]);
+        found = f->states[s].match;
+    }
+    if(!found && !DfaEolMatch(f, s)) return;
+
+    if(len + 1 > w->startsCap){
+        w->startsCap = (len + 1) * 2;
+        w->starts = realloc(w->starts, w->startsCap);
+        if(w->starts == NULL) Die("realloc");
+    }
+
+    s = DfaStart(r, 1, 1);
+    for(int i = len; ; --i){
+        w->starts[i] = r->states[s].match || (i == 0 && DfaEolMatch(r, s));
+        if(i == 0) break;
+        s = DfaNext(r, s, t[i - 1]);
+    }
+
+    int pos = 0;
+    while(pos <= len){
+        while(pos <= len && !w->starts[pos]) pos++;
+        if(pos > len) break;
+
+        s = DfaStart(f, 0, pos == 0);
+        int end = f->states[s].match ? pos : -1;
+        int i;
+        for(i = pos; i < len; ++i){
+            s = DfaNext(f, s, t[i]);
+            if(DfaDead(f, s)) break;
+            if(f->states[s].match) end = i + 1;
+        }
+        if(i == len && DfaEolMatch(f, s)) end = len;
+
+        if(end > pos){
+            SearchPush(w, row, pos, end - pos);
+            pos = end;
         }
         else {
-            row->render[idx++] = row->chars[j];
+            pos++; // Empty matches are not worth showing
+        }
+    }
+}
+
+static void (*SearchRowKernel)(struct searchWork*, int, const char*, int) = NULL;
+
+void SearchSelectKernel(){
+    SearchRowKernel = SearchRowScalar;
+
+#ifdef JEDITOR_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) SearchRowKernel = SearchRowAVX2;
+    else if(__builtin_cpu_supports("sse2")) SearchRowKernel = SearchRowSSE2;
+#endif
+}
+
+static void* SearchWorker(void* arg){
+    struct searchWork* w = arg;
+
+    for(int j = w->from; j < w->to; ++j){
+        if(w->re) RegexSearchRow(w, j, EditorRowText(j), EditorRowSize(j));
+        else SearchRowKernel(w, j, EditorRowText(j), EditorRowSize(j));
+    }
+
+    if(w->re) free(w->starts);
+
+    return NULL;
+}
+
+void SearchScan(struct searchIndex* s){
+    if(SearchRowKernel == NULL) SearchSelectKernel();
+
+    struct searchWork work[JEDITOR_MAX_THREADS];
+    pthread_t threads[JEDITOR_MAX_THREADS];
+    int numWorkers = WorkerCount(E.buf->numRows, JEDITOR_SEARCH_MIN_ROWS);
+
+    if(s->re){ // Every DFA is either empty or built for dfaPattern
+        int same = s->dfaPattern && !strcmp(s->dfaPattern, s->query);
+        if(s->dfas == NULL){
+            s->dfas = calloc(JEDITOR_MAX_THREADS * 2, sizeof(struct dfa));
+            if(s->dfas == NULL) Die("calloc");
+        }
+        if(!same){
+            free(s->dfaPattern);
+            s->dfaPattern = strdup(s->query);
+        }
+
+        for(int j = 0; j < JEDITOR_MAX_THREADS; ++j){
+            if(j >= numWorkers && s->dfas[j * 2].states == NULL) break;
+            DfaReuse(&s->dfas[j * 2], &s->re->forward, same);
+            DfaReuse(&s->dfas[j * 2 + 1], &s->re->reverse, same);
+        }
+    }
+
+    for(int j = 0; j < numWorkers; ++j){
+        struct searchWork* w = &work[j];
+        memset(w, 0, sizeof(*w));
+        w->query = s->query;
+        w->queryLen = s->queryLen;
+        w->re = s->re;
+        if(s->re){
+            w->forward = &s->dfas[j * 2];
+            w->reverse = &s->dfas[j * 2 + 1];
+        }
+        w->from = (long long)E.buf->numRows * j / numWorkers;
+        w->to = (long long)E.buf->numRows * (j + 1) / numWorkers;
+
+        if(j > 0 && pthread_create(&threads[j], NULL, SearchWorker, w) != 0){
+            Die("pthread_create");
+        }
+    }
+
+    SearchWorker(&work[0]);
+
+    s->count = 0;
+    for(int j = 0; j < numWorkers; ++j){
+        if(j > 0) pthread_join(threads[j], NULL);
+
+        struct searchWork* w = &work[j];
+        if(s->count + w->count > s->cap){
+            s->cap = (s->count + w->count) * 2;
+            s->matches = realloc(s->matches, sizeof(struct searchMatch) * s->cap);
+            if(s->matches == NULL) Die("realloc");
+        }
+
+        memcpy(&s->matches[s->count], w->matches, sizeof(struct searchMatch) * w->count);
+        s->count += w->count;
+        free(w->matches);
+    }
+}
+
+// Keeps the matches that still match after the query grew
+void SearchNarrow(struct searchIndex* s){
+    int kept = 0;
+
+    for(int j = 0; j < s->count; ++j){
+        struct searchMatch* m = &s->matches[j];
+        if(m->col + s->queryLen <= EditorRowSize(m->row) && !memcmp(EditorRowText(m->row) + m->col, s->query, s->queryLen)){
+            m->len = s->queryLen;
+            s->matches[kept++] = *m;
+        }
+    }
+
+    s->count = kept;
+}
+
+void SearchFree(struct searchIndex* s){
+    free(s->query);
+    free(s->matches);
+    RegexFree(s->re);
+
+    if(s->dfas){
+        for(int j = 0; j < JEDITOR_MAX_THREADS * 2; ++j){
+            if(s->dfas[j].states) DfaFree(&s->dfas[j]);
         }
     }
+    free(s->dfas);
+    free(s->dfaPattern);
+}
 
-    row->render[idx] = '\0';
-    row->rndrSize = idx;
+void SearchReset(struct searchIndex* s, int regex){
+    free(s->query);
+    RegexFree(s->re);
+    s->query = NULL;
+    s->queryLen = 0;
+    s->re = NULL;
+    s->regex = regex;
+    s->count = 0;
+    s->current = -1;
+}
+
+void SearchUpdate(struct searchIndex* s, const char* query){
+    int len = strlen(query);
+    // Narrowing needs the matches of a scan for a shorter, non-empty query
+    int grew = s->query && s->queryLen > 0 && s->numRows == E.buf->numRows &&
+               len >= s->queryLen && !strncmp(query, s->query, s->queryLen);
+
+    if(grew && len == s->queryLen) return;
+
+    free(s->query);
+    s->query = strdup(query);
+    s->queryLen = len;
+    s->numRows = E.buf->numRows;
 
-    EditorUpdateSyntax(row);
+    if(s->regex){
+        RegexFree(s->re);
+        s->re = len ? RegexCompile(query) : NULL; // Invalid while being typed, like "a(b"
+
+        if(s->re) SearchScan(s);
+        else s->count = 0;
+    }
+    else if(len == 0) s->count = 0;
+    else if(grew) SearchNarrow(s);
+    else SearchScan(s);
 }
 
-void EditorInsertRow(int at, char* str, size_t len){
-    if(at < 0 || at > E.numRows) return;
+// Index of the first match on or after row, or s->count
+int SearchFirstInRow(struct searchIndex* s, int row){
+    int lo = 0, hi = s->count;
+
+    while(lo < hi){
+        int mid = lo + (hi - lo) / 2;
+        if(s->matches[mid].row < row) lo = mid + 1;
+        else hi = mid;
+    }
+
+    return lo;
+}
+
+// Index of the first match on row that ends after byte col, or of the first
+// one on a later row. Matches of a row are as long as each other (literal) or
+// never overlap (regex), so their ends are sorted too.
+int SearchFirstEndingAfter(struct searchIndex* s, int row, int col){
+    int lo = 0, hi = s->count;
+
+    while(lo < hi){
+        int mid = lo + (hi - lo) / 2;
+        struct searchMatch* m = &s->matches[mid];
+        if(m->row < row || (m->row == row && m->col + m->len <= col)) lo = mid + 1;
+        else hi = mid;
+    }
+
+    return lo;
+}
+
+/*==== FIND ====*/
 
-    E.row = realloc(E.row, sizeof(eRow) * (E.numRows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(eRow) * (E.numRows - at));
-    for(int j = at + 1; j <= E.numRows; ++j) E.row[j].idx++;
+void EditorFindCallback(char* query, int key){
+    struct searchIndex* s = &E.buf->search;
+    int step = 0;
 
-    E.row[at].idx = at;
+    if(key == '\r' || key == '\x1b'){
+        s->current = -1;
+        return;
+    }
+    else if (key == ARROW_RIGHT || key == ARROW_DOWN){
+        step = 1;
+    }
+    else if (key == ARROW_LEFT || key == ARROW_UP){
+        step = -1;
+    }
+    else {
+        SearchUpdate(s, query);
+        s->current = -1;
+        step = 1;
+    }
 
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, str, len);
-    E.row[at].chars[len] = '\0';
+    if(s->count == 0){
+        s->current = -1;
+        return;
+    }
 
-    E.row[at].rndrSize = 0;
-    E.row[at].render = NULL;
-    E.row[at].highlight = NULL;
-    E.row[at].hlOpenComment = 0;
-    EditorUpdateRow(&E.row[at]);
+    s->current = (s->current == -1) ? 0 : (s->current + step + s->count) % s->count;
 
-    E.numRows++;
-    E.dirty++;
+    struct searchMatch* m = &s->matches[s->current];
+    E.buf->curY = m->row;
+    E.buf->curX = m->col;
+    E.buf->rowOff = E.buf->numRows;
 }
 
-void EditorFreeRow(eRow* row){
-    free(row->render);
-    free(row->chars);
-    free(row->highlight);
+void EditorFind(int regex){
+    int savedCurX   = E.buf->curX;    
+    int savedCurY   = E.buf->curY;
+    int savedColOff = E.buf->colOff;
+    int savedRowOff = E.buf->rowOff;
+
+    SearchReset(&E.buf->search, regex);
+    char* query = EditorPrompt(regex ? "Regex: %s (ESC | ARROWS | ENTER)" : "Search: %s (ESC | ARROWS | ENTER)", EditorFindCallback);
+
+    if(query){
+        free(query);
+    }
+    else {
+        E.buf->curX = savedCurX;
+        E.buf->curY = savedCurY;
+        E.buf->colOff = savedColOff;
+        E.buf->rowOff = savedRowOff;
+    }
 }
 
-void EditorDelRow(int at){
-    if(at < 0 || at >= E.numRows) return;
+/*==== FOLLOW ====*/
+
+// Following a file keeps reading what is appended to it, for logs that are
+// still being written. inotify reports writes, then only the bytes past the
+// last offset are read and added as rows. The view stays on the last row
+// unless the cursor was moved off it, and with maxRows set the oldest rows
+// are dropped to keep memory bounded.
+
+void EditorUnfollow(){
+    struct follow* f = &E.buf->follow;
+    if(f->piped) EditorPipeAbandon();
+    if(f->fd == -1) return;
+
+    inotify_rm_watch(E.inotifyFd, f->wd);
+    close(f->fd);
+    f->fd = -1;
+}
 
-    EditorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(eRow) * (E.numRows - at - 1));
-    for(int j = at; j < E.numRows - 1; ++j) E.row[j].idx--;
-    E.numRows--;
-    E.dirty++;
+// Keeps the view on the same rows after drop were removed from the top
+void EditorFollowDropped(int drop){
+    E.buf->curY = E.buf->curY > drop ? E.buf->curY - drop : 0;
+    E.buf->rowOff = E.buf->rowOff > drop ? E.buf->rowOff - drop : 0;
 }
 
-void EditorRowInsertChar(eRow* row, int at, int c){
-    if(at < 0 || at > row->size) at = row->size;
+// Drops rows from the top until at most maxRows are left
+void EditorFollowTrim(){
+    struct follow* f = &E.buf->follow;
+    int drop = f->maxRows ? E.buf->numRows - f->maxRows : 0;
+    if(drop <= 0) return;
 
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    EditorUpdateRow(row);
+    int dirty = E.buf->dirty;
+    for(int j = 0; j < drop; ++j) EditorDelRow(0);
+    E.buf->dirty = dirty;
 
-    E.dirty++;
+    EditorFollowDropped(drop);
 }
 
-void EditorRowAppendString(eRow* row, char* str, size_t len){
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], str, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    EditorUpdateRow(row);
-    E.dirty++;
+// Whether row at still reads its bytes from the file mapping
+int EditorRowMapped(int at){
+    struct sharedMap* sm = E.buf->map;
+    const char* text = EditorRowText(at);
+    return sm && text >= sm->addr && text <= sm->addr + sm->len;
 }
 
-void EditorRowDelChar(eRow* row, int at){
-    if(at < 0 || at >= row->size) return;
+// Copies the rows still pointing into the file mapping into the load arena and
+// drops the mapping. With maxRows this runs after trimming, so only the rows
+// that are kept get copied.
+void EditorFollowUnmap(){
+    for(int j = 0; j < E.buf->numRows; ++j){
+        if(!EditorRowMapped(j)) continue;
+        const char** text = &E.buf->rows.text[EditorRowSlot(j)];
+        *text = RowMemCopyText(&E.buf->mem, *text, EditorRowSize(j));
+    }
 
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    EditorUpdateRow(row);
-    E.dirty++;
+    SharedMapRelease(E.buf->map);
+    E.buf->map = NULL;
 }
 
-/*==== EDITOR OPERATIONS ====*/
+// The file was truncated under its mapping, e.g. by copytruncate log rotation,
+// and reading a mapping past the end of its file raises SIGBUS. The rows read
+// from it are gone from the file, so they are dropped without being touched,
+// down to the last one still pointing into it.
+void EditorFollowDropMapped(){
+    if(E.buf->map == NULL) return;
 
-void EditorInsertChar(int c){
-    if(E.curY == E.numRows){ // If we are on ~
-        EditorInsertRow(E.numRows, "", 0);
+    int drop = 0;
+    for(int j = 0; j < E.buf->numRows; ++j){
+        if(EditorRowMapped(j)) drop = j + 1;
     }
 
-    EditorRowInsertChar(&E.row[E.curY], E.curX, c);
-    E.curX++;
+    int dirty = E.buf->dirty;
+    EditorDelRows(0, drop);
+    if(E.buf->numRows > 0) EditorSyntaxInvalidate(0);
+    E.buf->dirty = dirty;
+
+    EditorFollowDropped(drop);
+    SharedMapRelease(E.buf->map);
+    E.buf->map = NULL;
 }
 
-void EditorInsertNewline(){
-    if(E.curX == 0){
-        EditorInsertRow(E.curY, "", 0);
+// Adds a chunk of new file bytes as rows, completing the last row first if it had no '\n'
+void EditorFollowIngest(const char* data, size_t len){
+    struct follow* f = &E.buf->follow;
+    size_t start = 0;
+
+    while(start < len){
+        const char* nl = memchr(data + start, '\n', len - start);
+        size_t end = nl ? (size_t)(nl - data) : len;
+        size_t lineEnd = end;
+        if(nl) while(lineEnd > start && data[lineEnd - 1] == '\r') lineEnd--;
+
+        if(f->partial){
+            int at = E.buf->numRows - 1;
+            int size = EditorRowSize(at);
+            eRow* row = EditorRowMaterialize(at);
+            size_t add = lineEnd - start;
+
+            EditorRowReserveChars(at, size + add);
+            memcpy(&row->chars[size], data + start, add);
+            row->chars[size + add] = '\0';
+            EditorRowSetSize(at, size + add);
+            EditorUpdateRowSpan(at, size, 0, add);
+        }
+        else if(f->maxRows){ // Rows will be dropped again, so they need memory that can be freed
+            EditorInsertRow(E.buf->numRows, (char*)data + start, lineEnd - start);
+        }
+        else {
+            size_t add = lineEnd - start;
+            EditorInsertMappedRow(E.buf->numRows, RowMemCopyText(&E.buf->mem, data + start, add), add);
+        }
+
+        f->partial = (nl == NULL);
+        start = end + 1;
     }
-    else {
-        eRow* row = &E.row[E.curY];
-        EditorInsertRow(E.curY + 1, &row->chars[E.curX], row->size - E.curX);
-        row = &E.row[E.curY];
-        row->size = E.curX;
-        row->chars[row->size] = '\0';
-        EditorUpdateRow(row);
+}
+
+// Reads whatever was appended to the current buffer's file. Returns whether rows changed.
+int EditorFollowRead(){
+    struct follow* f = &E.buf->follow;
+    static char chunk[JEDITOR_FOLLOW_READ];
+
+    struct stat st;
+    if(fstat(f->fd, &st) == -1) return 0;
+
+    if(st.st_size < f->offset){ // Truncated, e.g. by log rotation: carry on from its new start
+        EditorFollowDropMapped();
+        f->offset = 0;
+        f->partial = 0;
+        EditorSetStatusMessage("%s was truncated", E.buf->filename);
     }
 
-    E.curY++;
-    E.curX = 0;
-}
+    if(st.st_size == f->offset) return 0;
 
-void EditorDelChar(){
-    if(E.curY == E.numRows) return;
-    if(E.curX == 0 && E.curY == 0) return;
+    int dirty = E.buf->dirty;
+    int pinned = E.buf->curY >= E.buf->numRows - 1;
+    ssize_t n;
 
-    eRow* row = &E.row[E.curY];
-    if(E.curX > 0){
-        EditorRowDelChar(row, E.curX - 1);
-        E.curX--;
+    while((n = pread(f->fd, chunk, sizeof(chunk), f->offset)) > 0){
+        EditorFollowIngest(chunk, n);
+        EditorFollowTrim();
+        f->offset += n;
     }
-    else {
-        E.curX = E.row[E.curY - 1].size;
-        EditorRowAppendString(&E.row[E.curY - 1], row->chars, row->size);
-        EditorDelRow(E.curY);
-        E.curY--;
+
+    E.buf->dirty = dirty; // The file grew, the buffer did not drift from it
+
+    if(pinned){
+        E.buf->curY = E.buf->numRows > 0 ? E.buf->numRows - 1 : 0;
+        E.buf->curX = 0;
     }
+
+    return 1;
 }
 
-/*==== FILE I/O ====*/
+// Starts following the current buffer's file, keeping at most maxRows rows if set
+void EditorFollow(int maxRows){
+    struct follow* f = &E.buf->follow;
 
-char* EditorRowsToString(int* bufLen){
-    int totalLen = 0;
-    int j;
-    for(j = 0; j < E.numRows; ++j){
-        totalLen += E.row[j].size + 1;
+    if(E.inotifyFd == -1){
+        E.inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if(E.inotifyFd == -1) Die("inotify_init1");
     }
 
-    *bufLen = totalLen;
+    f->fd = open(E.buf->filename, O_RDONLY);
+    if(f->fd == -1) Die("open");
 
-    char* buf = malloc(totalLen);
-    char* ptr = buf;
+    f->wd = inotify_add_watch(E.inotifyFd, E.buf->filename, IN_MODIFY);
+    if(f->wd == -1) Die("inotify_add_watch");
 
-    for(j = 0; j < E.numRows; ++j){
-        memcpy(ptr, E.row[j].chars, E.row[j].size);
-        ptr += E.row[j].size;
-        *ptr = '\n';
-        ptr++;
+    // Rows so far came from the mapping, so reading resumes where it ends
+    f->offset = E.buf->map ? (off_t)E.buf->map->len : 0;
+    f->partial = f->offset > 0 && E.buf->map->addr[f->offset - 1] != '\n';
+    f->maxRows = maxRows;
+    if(maxRows){ // Trimmed rows are never freed from the mapping or the arena, so keep neither
+        EditorFollowTrim();
+        EditorFollowUnmap();
     }
 
-    return buf;
+    EditorFollowRead();
+    EditorFollowTrim();
+    E.buf->curY = E.buf->numRows > 0 ? E.buf->numRows - 1 : 0;
 }
 
-void EditorOpen(char* file){
-    free(E.filename);
-    E.filename = strdup(file);
+// Picks up appends to every followed file. Returns whether the buffer on
+// screen changed.
+int EditorFollowPoll(){
+    if(E.inotifyFd == -1) return 0;
 
-    EditorSelectSyntaxHighlight();
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int any = 0;
+    while(read(E.inotifyFd, events, sizeof(events)) > 0) any = 1;
+    if(!any) return 0;
 
-    FILE* fptr = fopen(file, "r");
-    if(!fptr) Die("fopen");
+    struct editorBuffer* current = E.buf;
+    int redraw = 0;
 
-    char* line = NULL;
-    size_t lineCap = 0;
-    ssize_t lineLen;
+    for(int j = 0; j < E.numBuffers; ++j){
+        E.buf = E.buffers[j];
+        if(E.buf->follow.fd != -1 && EditorFollowRead() && E.buf == current) redraw = 1;
+    }
 
-    while((lineLen = getline(&line, &lineCap, fptr)) != -1){
-        while(lineLen > 0 && (line[lineLen - 1] == '\n' || line[lineLen - 1] == '\r')){
-            lineLen--;
+    E.buf = current;
+    return redraw;
+}
+
+/*==== PIPE INPUT ====*/
+
+// Data piped into stdin is read by a background thread while keys come from
+// /dev/tty. The input loop takes whatever has arrived and adds it as rows like
+// a followed file, so they can be viewed while the rest is still coming. The
+// thread stops reading once JEDITOR_PIPE_PENDING bytes are waiting.
+
+struct pipeReader {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t drained;
+    char* data;   // Read by the thread, not rows yet
+    size_t len;
+    size_t cap;
+    char* spare;  // Swapped with data, only touched by the input loop
+    size_t spareCap;
+    int eof;
+    int err;
+    struct editorBuffer* buf; // NULL once nothing more is wanted
+};
+
+struct pipeReader pipeReader = {.lock = PTHREAD_MUTEX_INITIALIZER, .drained = PTHREAD_COND_INITIALIZER};
+
+static void* PipeReaderMain(void* arg){
+    struct pipeReader* r = arg;
+    char chunk[JEDITOR_FOLLOW_READ];
+
+    while(1){
+        ssize_t n = read(STDIN_FILENO, chunk, sizeof(chunk));
+        if(n == -1 && errno == EINTR) continue;
+
+        pthread_mutex_lock(&r->lock);
+        if(n > 0){
+            while(r->len >= JEDITOR_PIPE_PENDING) pthread_cond_wait(&r->drained, &r->lock);
+
+            if(r->len + n > r->cap){
+                r->cap = r->cap ? r->cap * 2 : JEDITOR_FOLLOW_READ * 4;
+                r->data = realloc(r->data, r->cap);
+                if(r->data == NULL) Die("realloc");
+            }
+
+            memcpy(r->data + r->len, chunk, n);
+            r->len += n;
         }
-        EditorInsertRow(E.numRows, line, lineLen);
+        else {
+            r->eof = 1;
+            r->err = n == -1 ? errno : 0;
+        }
+        pthread_mutex_unlock(&r->lock);
+        EditorWake();
+
+        if(n <= 0) return NULL;
+    }
+}
+
+// Starts filling the current buffer from stdin, keeping at most maxRows rows if set
+void EditorPipeOpen(int maxRows){
+    struct pipeReader* r = &pipeReader;
+
+    r->buf = E.buf;
+    E.buf->follow.piped = 1;
+    E.buf->follow.maxRows = maxRows;
+
+    if(pthread_create(&r->thread, NULL, PipeReaderMain, r) != 0) Die("pthread_create");
+    pthread_detach(r->thread);
+
+    EditorSetStatusMessage("Reading from stdin...");
+}
+
+// The buffer is going away, leave whatever else comes in unread
+void EditorPipeAbandon(){
+    pipeReader.buf = NULL;
+    E.buf->follow.piped = 0;
+}
+
+// Adds what arrived on stdin as rows. Returns whether the buffer on screen changed.
+int EditorPipePoll(){
+    struct pipeReader* r = &pipeReader;
+    if(r->buf == NULL) return 0;
+
+    pthread_mutex_lock(&r->lock);
+    char* data = r->data;
+    size_t len = r->len;
+    size_t cap = r->cap;
+    int eof = r->eof;
+
+    r->data = r->spare;
+    r->cap = r->spareCap;
+    r->len = 0;
+    pthread_cond_signal(&r->drained);
+    pthread_mutex_unlock(&r->lock);
+
+    r->spare = data;
+    r->spareCap = cap;
+    if(len == 0 && !eof) return 0;
+
+    struct editorBuffer* current = E.buf;
+    E.buf = r->buf;
+
+    int dirty = E.buf->dirty;
+    int pinned = E.buf->numRows > 0 && E.buf->curY >= E.buf->numRows - 1;
+
+    EditorFollowIngest(data, len);
+    EditorFollowTrim();
+    E.buf->dirty = dirty;
+
+    if(pinned) E.buf->curY = E.buf->numRows - 1;
+
+    if(eof){
+        if(r->err) EditorSetStatusMessage("Error reading stdin: %s", strerror(r->err));
+        else EditorSetStatusMessage("Read %d lines from stdin", E.buf->numRows);
+
+        E.buf->follow.piped = 0;
+        r->buf = NULL;
+        free(r->data);
+        free(r->spare);
+        r->data = r->spare = NULL;
     }
 
-    free(line);
-    fclose(fptr);
-    E.dirty = 0;
+    int redraw = (E.buf == current);
+    E.buf = current;
+    return redraw;
 }
 
-void EditorSave(){
-    if(E.filename == NULL){
-        E.filename = EditorPrompt("Save as: %s", NULL);
-        if(E.filename == NULL){
-            EditorSetStatusMessage("Save aborted!");
-            return;
-        }
+/*==== BUFFERS ====*/
 
-        EditorSelectSyntaxHighlight();
+void EditorSwitchBuffer(int index){
+    E.buf = E.buffers[index];
+}
+
+int EditorBufferIndex(){
+    for(int j = 0; j < E.numBuffers; ++j){
+        if(E.buffers[j] == E.buf) return j;
+    }
+
+    return 0;
+}
+
+// Adds an empty buffer and switches to it
+void EditorNewBuffer(){
+    struct editorBuffer* b = calloc(1, sizeof(*b));
+    if(b == NULL) Die("calloc");
+
+    b->search.current = -1;
+    b->journal.fd = -1;
+    b->follow.fd = -1;
+
+    E.buffers = realloc(E.buffers, sizeof(*E.buffers) * (E.numBuffers + 1));
+    if(E.buffers == NULL) Die("realloc");
+
+    E.buffers[E.numBuffers++] = b;
+    EditorSwitchBuffer(E.numBuffers - 1);
+}
+
+// Closes the current buffer, throwing away unsaved edits. There is always at
+// least one buffer, so closing the last one leaves an empty one.
+void EditorCloseBuffer(){
+    struct editorBuffer* b = E.buf;
+
+    EditorSaveReap(1);
+    EditorUnfollow();
+    JournalClose(&b->journal);
+    free(b->journal.path);
+    free(b->journal.buf);
+
+    EditorFreeRows();
+    free(b->rows.size);
+    free(b->rows.text);
+    free(b->rows.hlState);
+    free(b->rows.data);
+
+    UndoFreeBlocks(b->undo.head);
+    SearchFree(&b->search);
+    free(b->filename);
+
+    int index = EditorBufferIndex();
+    memmove(&E.buffers[index], &E.buffers[index + 1], sizeof(*E.buffers) * (E.numBuffers - index - 1));
+    E.numBuffers--;
+    free(b);
+
+    if(E.numBuffers == 0) EditorNewBuffer();
+    else EditorSwitchBuffer(index < E.numBuffers ? index : E.numBuffers - 1);
+}
+
+void EditorOpenPrompt(){
+    char* file = EditorPrompt("Open: %s (ESC to cancel)", NULL);
+    if(file == NULL) return;
+
+    int prev = EditorBufferIndex();
+    EditorNewBuffer();
+
+    if(EditorOpen(file) == -1){
+        EditorSetStatusMessage("Cannot open %s: %s", file, strerror(errno));
+        EditorCloseBuffer();
+        EditorSwitchBuffer(prev);
+    }
+
+    free(file);
+}
+
+void EditorCycleBuffer(int step){
+    int index = (EditorBufferIndex() + step + E.numBuffers) % E.numBuffers;
+    EditorSwitchBuffer(index);
+    EditorSetStatusMessage("Buffer %d/%d: %s", index + 1, E.numBuffers, E.buf->filename ? E.buf->filename : "[No Name]");
+}
+
+int EditorAnyDirty(){
+    for(int j = 0; j < E.numBuffers; ++j){
+        if(E.buffers[j]->dirty) return 1;
     }
 
+    return 0;
+}
+
+/*==== APPEND BUFFER ====*/
+
+struct abuf {
+    char* buf;
     int len;
-    char* buf = EditorRowsToString(&len);
+    int cap;
+};
 
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644); // 0644 is standard permission for owner to read write
-    if(fd != -1){
-        if(ftruncate(fd, len) != -1){
-            if(write(fd, buf, len) == len){
-                close(fd);
-                free(buf);
+#define ABUF_INIT {NULL, 0, 0}
+#define ABUF_MIN_CAP 4096
 
-                E.dirty = 0;
-                EditorSetStatusMessage("%d bytes written to disk", len);
-                return;
+void abAppend(struct abuf* ab, const char* str, int len){
+    if(ab->len + len > ab->cap){
+        int cap = ab->cap ? ab->cap : ABUF_MIN_CAP;
+        while(cap < ab->len + len) cap *= 2;
+
+        char* new = realloc(ab->buf, cap);
+        if(new == NULL) return;
+
+        ab->buf = new;
+        ab->cap = cap;
+    }
+
+    memcpy(&ab->buf[ab->len], str, len);
+    ab->len += len;
+}
+
+void abFree(struct abuf* ab){
+    free(ab->buf);
+}
+
+// Writes all of buf, retrying short writes and interrupted calls
+int WriteAll(int fd, const char* buf, size_t len){
+    while(len > 0){
+        ssize_t n = write(fd, buf, len);
+
+        if(n == -1){
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN){
+                struct pollfd pfd = {fd, POLLOUT, 0};
+                poll(&pfd, 1, -1);
+                continue;
             }
+            return -1;
         }
-        close(fd);
+
+        buf += n;
+        len -= n;
     }
 
-    free(buf);
-    EditorSetStatusMessage("Cannot save! I/O error: %s", strerror(errno));
+    return 0;
 }
 
-/*==== FIND ====*/
+/*==== SCREEN ====*/
 
-void EditorFindCallback(char* query, int key){
-    static int lastMatch = -1;
-    static int direction = 1;
+// The frame is painted into E.back, one cell per terminal column, and only the
+// cells that differ from E.front (what the terminal is showing) are written
+// out. Scrolling the text area shifts the front rows with CSI S/T instead of
+// repainting them.
+
+#define SCREEN_ROWS (E.terminalRows + 2) // Text rows plus status and message bar
+#define SCREEN_REWRITE_GAP 4 // Unchanged cells rewritten instead of moving the cursor past them
+
+int ScreenCellEqual(struct screenCell* a, struct screenCell* b){
+    return !memcmp(a, b, sizeof(*a)); // Unused bytes of c are kept zero
+}
+
+void ScreenSetCell(struct screenCell* cell, const char* c, int len, unsigned char attr){
+    memset(cell->c, 0, sizeof(cell->c));
+    memcpy(cell->c, c, len);
+    cell->len = len;
+    cell->attr = attr;
+}
 
-    static int savedHLLine;
-    static char* savedHL = NULL;
+// Blanks the other half of a wide character that is about to lose the one at x
+void ScreenSplitWide(struct screenCell* line, int x){
+    if(line[x].len == 0 && x > 0) ScreenSetCell(&line[x - 1], " ", 1, line[x - 1].attr);
+    else if(x + 1 < E.terminalCols && line[x + 1].len == 0) ScreenSetCell(&line[x + 1], " ", 1, line[x].attr);
+}
+
+// SGR sequence for every cell attribute, built once in ScreenInit
+struct screenAttrSeq {
+    char seq[12];
+    int len;
+};
 
-    if(savedHL){
-        memcpy(E.row[savedHLLine].highlight, savedHL, E.row[savedHLLine].rndrSize);
-        free(savedHL);
-        savedHL = NULL;
+struct screenAttrSeq screenAttrSeqs[HL_MATCH + 1];
+
+void ScreenInitAttrSeqs(){
+    for(int hl = HL_NORMAL; hl <= HL_MATCH; ++hl){
+        struct screenAttrSeq* s = &screenAttrSeqs[hl];
+
+        if(hl == HL_NORMAL) s->len = snprintf(s->seq, sizeof(s->seq), "\x1b[m");
+        else s->len = snprintf(s->seq, sizeof(s->seq), "\x1b[0;%dm", EditorSyntaxToColor(hl));
     }
+}
 
-    if(key == '\r' || key == '\x1b'){
-        lastMatch = -1;
-        direction = 1;
-        return;
+void ScreenInit(){
+    int cells = SCREEN_ROWS * E.terminalCols;
+    E.front = calloc(cells, sizeof(struct screenCell));
+    E.back = calloc(cells, sizeof(struct screenCell));
+    if(E.front == NULL || E.back == NULL) Die("calloc");
+
+    E.screenValid = 0;
+    ScreenInitAttrSeqs();
+}
+
+void ScreenClearCells(struct screenCell* cells, int count){
+    if(count <= 0) return;
+
+    struct screenCell blank = {{' ', 0, 0, 0}, 1, HL_NORMAL};
+    cells[0] = blank;
+    for(int done = 1; done < count; done *= 2){ // Doubling copies of the cleared part
+        memcpy(&cells[done], cells, sizeof(*cells) * (done < count - done ? done : count - done));
     }
-    else if (key == ARROW_RIGHT || key == ARROW_DOWN){
-        direction = 1;
+}
+
+void ScreenClear(){
+    ScreenClearCells(E.back, SCREEN_ROWS * E.terminalCols);
+}
+
+// Puts a character of len bytes and width columns at y, x. A wide one that
+// does not fit before the edge is left as a space.
+void ScreenPutChar(int y, int x, const char* c, int len, int width, unsigned char attr){
+    if(y < 0 || y >= SCREEN_ROWS || x < 0 || x >= E.terminalCols) return;
+
+    struct screenCell* line = &E.back[y * E.terminalCols];
+    if(width > 1 && x + 1 >= E.terminalCols){
+        c = " ";
+        len = width = 1;
     }
-    else if (key == ARROW_LEFT || key == ARROW_UP){
-        direction = -1;
+
+    ScreenSplitWide(line, x);
+    if(width > 1){
+        ScreenSplitWide(line, x + 1);
+        ScreenSetCell(&line[x + 1], "", 0, attr);
+    }
+
+    ScreenSetCell(&line[x], c, len, attr);
+}
+
+void ScreenPut(int y, int x, char c, unsigned char attr){
+    if(y < 0 || y >= SCREEN_ROWS || x < 0 || x >= E.terminalCols) return;
+
+    struct screenCell* line = &E.back[y * E.terminalCols];
+    if(line[x].len == 0 || (x + 1 < E.terminalCols && line[x + 1].len == 0)) ScreenSplitWide(line, x);
+
+    struct screenCell cell = {{c, 0, 0, 0}, 1, attr};
+    line[x] = cell;
+}
+
+// Recolors a cell that was already drawn, control characters stay inverted
+void ScreenSetAttr(int y, int x, unsigned char attr){
+    if(y < 0 || y >= SCREEN_ROWS || x < 0 || x >= E.terminalCols) return;
+
+    struct screenCell* cell = &E.back[y * E.terminalCols + x];
+    if(!(cell->attr & CELL_INVERSE)) cell->attr = attr;
+}
+
+void ScreenPutString(int y, int x, const char* str, int len, unsigned char attr){
+    for(int j = 0; j < len && x < E.terminalCols;){
+        int width;
+        int n = Utf8Char(&str[j], len - j, &width);
+
+        if(width < 0) ScreenPut(y, x++, '?', attr);
+        else ScreenPutChar(y, x, &str[j], n, width, attr);
+
+        x += width > 0 ? width : 0;
+        j += n;
+    }
+}
+
+void ScreenEmitAttr(struct abuf* ab, unsigned char attr){
+    if(attr & CELL_INVERSE){
+        abAppend(ab, "\x1b[0;7m", 6);
+    }
+    else {
+        abAppend(ab, screenAttrSeqs[attr].seq, screenAttrSeqs[attr].len);
+    }
+}
+
+void ScreenEmitCell(struct abuf* ab, struct screenCell* cell, int* attr){
+    if(cell->attr != *attr){
+        *attr = cell->attr;
+        ScreenEmitAttr(ab, cell->attr);
+    }
+
+    abAppend(ab, cell->c, cell->len);
+}
+
+void ScreenMoveTo(struct abuf* ab, int y, int x){
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+    abAppend(ab, buf, len);
+}
+
+// Shifts the text area by the change in rowOff, if that keeps part of it
+void ScreenScroll(struct abuf* ab, struct editorBuffer* owner, int rowOff){
+    int shift = rowOff - E.screenRowOff;
+    int rows = E.terminalRows;
+    int cols = E.terminalCols;
+
+    if(owner != E.screenBuf) shift = 0; // A different buffer, not a scroll
+    E.screenRowOff = rowOff;
+    E.screenBuf = owner;
+    if(!E.screenValid || shift == 0 || abs(shift) >= rows) return;
+
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r", rows, abs(shift), shift > 0 ? 'S' : 'T');
+    abAppend(ab, buf, len);
+
+    int kept = rows - abs(shift);
+    if(shift > 0){
+        memmove(E.front, &E.front[shift * cols], sizeof(struct screenCell) * kept * cols);
+        ScreenClearCells(&E.front[kept * cols], abs(shift) * cols);
     }
     else {
-        lastMatch = -1;
-        direction = 1;
+        memmove(&E.front[-shift * cols], E.front, sizeof(struct screenCell) * kept * cols);
+        ScreenClearCells(E.front, -shift * cols);
+    }
+}
+
+// Appends what it takes to turn E.front into back, a frame of buf scrolled to
+// rowOff, and puts the cursor at curY, curX
+void ScreenFlush(struct abuf* ab, struct screenCell* backCells, struct editorBuffer* buf, int rowOff, int curY, int curX){
+    int cols = E.terminalCols;
+    int attr = HL_NORMAL;
+    int termY = -1, termX = -1; // Where writing leaves the terminal cursor, -1 if unknown
+
+    abAppend(ab, "\x1b[?25l", 6); // Hide cursor
+    int start = ab->len;
+
+    if(!E.screenValid){
+        abAppend(ab, "\x1b[m\x1b[2J", 7);
+        ScreenClearCells(E.front, SCREEN_ROWS * cols);
+    }
+
+    ScreenScroll(ab, buf, rowOff);
+
+    for(int y = 0; y < SCREEN_ROWS; ++y){
+        struct screenCell* front = &E.front[y * cols];
+        struct screenCell* back = &backCells[y * cols];
+
+        if(!memcmp(front, back, sizeof(struct screenCell) * cols)) continue;
+
+        int last = cols - 1; // Last cell of the new row that is not blank
+        while(last >= 0 && back[last].c[0] == ' ' && back[last].len == 1 && back[last].attr == HL_NORMAL) last--;
+
+        for(int x = 0; x < cols; ++x){
+            if(ScreenCellEqual(&front[x], &back[x])) continue;
+            if(back[x].len == 0) continue; // Drawn with its left half
+
+            if(termY == y && termX >= 0 && termX < x && x - termX <= SCREEN_REWRITE_GAP && x <= last){
+                for(int k = termX; k < x; ++k) ScreenEmitCell(ab, &back[k], &attr); // Cheaper than moving past them
+            }
+            else if(termY != y || termX != x){
+                ScreenMoveTo(ab, y, x);
+            }
+
+            if(x > last){
+                if(attr != HL_NORMAL) ScreenEmitAttr(ab, HL_NORMAL);
+                attr = HL_NORMAL;
+                abAppend(ab, "\x1b[K", 3);
+                termY = -1;
+                break;
+            }
+
+            ScreenEmitCell(ab, &back[x], &attr);
+            int width = (x + 1 < cols && back[x + 1].len == 0) ? 2 : 1;
+            termY = y;
+            termX = (x + width < cols) ? x + width : -1;
+        }
+
+        memcpy(front, back, sizeof(struct screenCell) * cols);
+    }
+
+    if(attr != HL_NORMAL) ScreenEmitAttr(ab, HL_NORMAL);
+
+    if(ab->len == start && E.screenValid && curY == E.screenCurY && curX == E.screenCurX){
+        ab->len = 0; // Nothing changed, not even the cursor
+        return;
     }
 
-    if(lastMatch == -1) direction = 1;
-    int current = lastMatch;
+    E.screenValid = 1;
+    E.screenCurY = curY;
+    E.screenCurX = curX;
+
+    ScreenMoveTo(ab, curY, curX);
+    abAppend(ab, "\x1b[?25h", 6); // Show cursor
+}
+
+/*==== RENDERER ====*/
+
+// With a terminal, frames are written by a thread of their own so a terminal
+// that is slow to take output never holds up keys. The input loop draws the
+// visible rows into E.back and hands a copy over. The thread writes at most one
+// frame every JEDITOR_FRAME_MS, and a frame handed over while one is waiting
+// replaces it. Without the thread (the bench) frames are written right away.
+
+struct renderer {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct screenCell* frame; // The latest frame handed over, guarded by lock
+    struct screenCell* work;  // The frame being written, only touched by the thread
+    struct editorBuffer* buf;
+    int rowOff;
+    int curY;
+    int curX;
+    int pending;
+    int repaint;
+    int stop;
+    int running;
+};
 
-    int i;
-    for(i = 0; i < E.numRows; ++i){
-        current += direction;
-        if(current == -1) current = E.numRows - 1;
-        else if(current == E.numRows) current = 0;
+struct renderer renderer = {.lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER};
+
+static void* RendererMain(void* arg){
+    struct renderer* r = arg;
+    struct abuf ab = ABUF_INIT;
+    long long last = 0;
 
-        eRow* row = &E.row[current];
-        char* match = strstr(row->render, query);
+    pthread_mutex_lock(&r->lock);
+    while(1){
+        while(!r->pending && !r->stop) pthread_cond_wait(&r->ready, &r->lock);
+        if(r->stop) break;
+
+        long long wait = last + JEDITOR_FRAME_MS - EditorMs();
+        if(wait > 0){ // Frames handed over meanwhile replace this one
+            pthread_mutex_unlock(&r->lock);
+            struct timespec ts = {0, wait * 1000000};
+            nanosleep(&ts, NULL);
+            pthread_mutex_lock(&r->lock);
+            if(r->stop) break;
+        }
 
-        if(match){
-            lastMatch = current;
+        struct screenCell* frame = r->frame;
+        r->frame = r->work;
+        r->work = frame;
+        r->pending = 0;
+        if(r->repaint) E.screenValid = 0;
+        r->repaint = 0;
 
-            E.curY = current;
-            E.curX = EditorRowRendrXToCurX(row, match - row->render);
-            E.rowOff = E.numRows;
+        struct editorBuffer* buf = r->buf;
+        int rowOff = r->rowOff, curY = r->curY, curX = r->curX;
+        pthread_mutex_unlock(&r->lock);
 
-            savedHLLine = current;
-            savedHL = malloc(row->rndrSize);
-            memcpy(savedHL, row->highlight, row->rndrSize);
-            memset(&row->highlight[match - row->render], HL_MATCH, strlen(query));
-            break;
-        }
+        ab.len = 0;
+        ScreenFlush(&ab, r->work, buf, rowOff, curY, curX);
+        if(ab.len) E.term->write(ab.buf, ab.len);
+        last = EditorMs();
+
+        pthread_mutex_lock(&r->lock);
     }
+    pthread_mutex_unlock(&r->lock);
+
+    abFree(&ab);
+    return NULL;
 }
 
-void EditorFind(){
-    int savedCurX   = E.curX;    
-    int savedCurY   = E.curY;
-    int savedColOff = E.colOff;
-    int savedRowOff = E.rowOff;
+void EditorRenderStart(){
+    struct renderer* r = &renderer;
+    int cells = SCREEN_ROWS * E.terminalCols;
 
-    char* query = EditorPrompt("Search: %s (ESC | ARROWS | ENTER)", EditorFindCallback);
+    r->frame = calloc(cells, sizeof(struct screenCell));
+    r->work = calloc(cells, sizeof(struct screenCell));
+    if(r->frame == NULL || r->work == NULL) Die("calloc");
 
-    if(query){
-        free(query);
-    }
-    else {
-        E.curX = savedCurX;
-        E.curY = savedCurY;
-        E.colOff = savedColOff;
-        E.rowOff = savedRowOff;
-    }
+    if(pthread_create(&r->thread, NULL, RendererMain, r) != 0) return; // Frames are written inline instead
+    r->running = 1;
 }
 
-/*==== APPEND BUFFER ====*/
-
-struct abuf {
-    char* buf;
-    int len;
-};
+// Waits for the frame being written, the rest are dropped
+void EditorRenderStop(){
+    struct renderer* r = &renderer;
+    if(!r->running || pthread_equal(pthread_self(), r->thread)) return;
 
-#define ABUF_INIT {NULL, 0}
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    pthread_cond_signal(&r->ready);
+    pthread_mutex_unlock(&r->lock);
 
-void abAppend(struct abuf* ab, const char* str, int len){
-    char* new = realloc(ab->buf, ab->len + len);
+    pthread_join(r->thread, NULL);
+    r->running = 0;
+}
 
-    if(new == NULL) return;
+// Makes the next frame repaint the whole terminal
+void ScreenInvalidate(){
+    struct renderer* r = &renderer;
+    if(!r->running){
+        E.screenValid = 0;
+        return;
+    }
 
-    memcpy(&new[ab->len], str, len);
-    ab->buf = new;
-    ab->len += len;
+    pthread_mutex_lock(&r->lock);
+    r->repaint = 1;
+    pthread_mutex_unlock(&r->lock);
 }
 
-void abFree(struct abuf* ab){
-    free(ab->buf);
+void EditorRenderSubmit(int curY, int curX){
+    struct renderer* r = &renderer;
+
+    pthread_mutex_lock(&r->lock);
+    memcpy(r->frame, E.back, sizeof(struct screenCell) * SCREEN_ROWS * E.terminalCols);
+    r->buf = E.buf;
+    r->rowOff = E.buf->rowOff;
+    r->curY = curY;
+    r->curX = curX;
+    r->pending = 1;
+    pthread_cond_signal(&r->ready);
+    pthread_mutex_unlock(&r->lock);
 }
 
 /*==== OUTPUT ====*/
 
 void EditorScroll(){
-    E.rndrX = 0;
-    if(E.curY < E.numRows){
-        E.rndrX = EditorRowCurXToRndrX(&E.row[E.curY], E.curX);
+    E.buf->rndrX = 0;
+    int width = 1; // Of the character under the cursor, all of which is kept on screen
+    if(E.buf->curY < E.buf->numRows){
+        eRow* row = EditorRowMaterialize(E.buf->curY);
+        E.buf->rndrX = EditorRowCurXToRndrX(row, E.buf->curX);
+
+        if(!row->ascii && E.buf->curX < EditorRowSize(E.buf->curY)) Utf8Char(&row->chars[E.buf->curX], 4, &width);
+        if(width < 1) width = 1;
     }
 
-    if(E.curY < E.rowOff){
-        E.rowOff = E.curY;
+    if(E.buf->curY < E.buf->rowOff){
+        E.buf->rowOff = E.buf->curY;
     }
     
-    if(E.curY >= E.rowOff + E.terminalRows){
-        E.rowOff = E.curY - E.terminalRows + 1;
+    if(E.buf->curY >= E.buf->rowOff + E.terminalRows){
+        E.buf->rowOff = E.buf->curY - E.terminalRows + 1;
     }
 
-    if(E.rndrX < E.colOff){
-        E.colOff = E.rndrX;
+    if(E.buf->rndrX < E.buf->colOff){
+        E.buf->colOff = E.buf->rndrX;
     }
 
-    if(E.rndrX >= E.colOff + E.terminalCols){
-        E.colOff = E.rndrX - E.terminalCols + 1;
+    if(E.buf->rndrX + width > E.buf->colOff + E.terminalCols){
+        E.buf->colOff = E.buf->rndrX + width - E.terminalCols;
     }
 }
 
-void EditorDrawRows(struct abuf *ab) {
+void EditorDrawRows(){
     int y;
 
     for (y = 0; y < E.terminalRows; y++) {
-        int fileRow = y + E.rowOff;
+        int fileRow = y + E.buf->rowOff;
 
-        if(fileRow >= E.numRows){
-            if (E.numRows == 0 && y == E.terminalRows / 3) {
+        if(fileRow >= E.buf->numRows){
+            if (E.buf->numRows == 0 && y == E.terminalRows / 3) {
                 char welcome[80];
                 int welcomelen = snprintf(welcome, sizeof(welcome), "JEDITOR -- version %s", JEDITOR_VERSION);
 
@@ -801,125 +4994,125 @@ void EditorDrawRows(struct abuf *ab) {
 
                 int padding = (E.terminalCols - welcomelen) / 2;
                 if (padding) {
-                    abAppend(ab, "~", 1);
-                    padding--;
+                    ScreenPut(y, 0, '~', HL_NORMAL);
                 }
 
-                while (padding--) abAppend(ab, " ", 1);
-
-                abAppend(ab, welcome, welcomelen);
+                ScreenPutString(y, padding, welcome, welcomelen, HL_NORMAL);
             }
             else {
-                abAppend(ab, "~", 1);
+                ScreenPut(y, 0, '~', HL_NORMAL);
             }
         } else {
-            int len = E.row[fileRow].rndrSize - E.colOff;
-            if(len < 0) len = 0;
-            if(len > E.terminalCols) len = E.terminalCols;
-            
-            char* c = &E.row[fileRow].render[E.colOff];
-            unsigned char* hl = &E.row[fileRow].highlight[E.colOff];
-            int curColor = -1;
-
-            int j;
-            for(j = 0; j < len; ++j){
-                if(iscntrl(c[j])){
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    abAppend(ab, "\x1b[7m", 4);
-                    abAppend(ab, &sym, 3);
-                    abAppend(ab, "\x1b[m", 3);
-                    
-                    if(curColor != -1){
-                        char buf[16];
-                        int cLen = snprintf(buf, sizeof(buf), "\x1b[%dm", curColor);
-                        abAppend(ab, buf, cLen);
-                    }
-                }
-                else if(hl[j] == HL_NORMAL){
-                    if(curColor != -1){
-                        abAppend(ab, "\x1b[39m", 5);
-                        curColor = -1;
+            eRow* row = EditorRowMaterialize(fileRow);
+            if(*EditorRowHlState(fileRow) == -1 && EditorUpdateSyntax(fileRow)) EditorSyntaxPropagate(fileRow);
+
+            if(row->chunked) EditorLongRowWindow(fileRow, E.buf->colOff, E.terminalCols);
+
+            char* c = row->render;
+            unsigned char* hl = row->highlight;
+
+            struct screenCell* line = &E.back[y * E.terminalCols];
+            int start;
+            int j = EditorRowRenderAt(row, E.buf->colOff, &start);
+            int x = start - E.buf->colOff; // Below 0 for a wide character cut by colOff
+            while(j < row->rndrSize && x < E.terminalCols){
+                unsigned char ch = c[j];
+                if(ch < 0x80 && x >= 0){ // Stored directly, the line is blank past x
+                    struct screenCell cell = {{ch, 0, 0, 0}, 1, hl[j]};
+                    if(ch < ' ' || ch == 127){
+                        cell.c[0] = (ch <= 26) ? '@' + ch : '?';
+                        cell.attr = CELL_INVERSE;
                     }
-                    abAppend(ab, &c[j], 1);
+
+                    line[x++] = cell;
+                    j++;
+                    continue;
                 }
-                else {
-                    int color = EditorSyntaxToColor(hl[j]);
-                    if(color != curColor){
-                        curColor = color;
-                        char buf[16];
-                        int cLen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        abAppend(ab, buf, cLen);
-                    }
 
-                    abAppend(ab, &c[j], 1);
+                int width;
+                int n = Utf8Char(&c[j], row->rndrSize - j, &width);
+                if(width < 0){
+                    ScreenPut(y, x, '?', CELL_INVERSE);
+                    width = 1;
                 }
+                else if(x < 0){
+                    for(int k = 0; k < x + width; ++k) ScreenPut(y, k, ' ', hl[j]);
+                }
+                else if(width > 0){
+                    ScreenPutChar(y, x, &c[j], n, width, hl[j]);
+                }
+
+                j += n;
+                x += width;
             }
 
-            abAppend(ab, "\x1b[39m", 5);
-        }
+            struct searchIndex* s = &E.buf->search; // Every match on screen is shown while searching
+            if(s->current >= 0){
+                int from, to;
+                EditorRowColsToBytes(row, EditorRowSize(fileRow), E.buf->colOff, E.terminalCols, &from, &to);
 
-        abAppend(ab, "\x1b[K", 3);
-        abAppend(ab, "\r\n", 2);
+                for(int m = SearchFirstEndingAfter(s, fileRow, from); m < s->count && s->matches[m].row == fileRow && s->matches[m].col < to; ++m){
+                    int from = EditorRowCurXToRndrX(row, s->matches[m].col) - E.buf->colOff;
+                    int to = EditorRowCurXToRndrX(row, s->matches[m].col + s->matches[m].len) - E.buf->colOff;
+
+                    for(int x = from; x < to; ++x) ScreenSetAttr(y, x, HL_MATCH);
+                }
+            }
+        }
     }
 }
 
-void EditorDrawStatusBar(struct abuf* ab){
-    abAppend(ab, "\x1b[7m", 4); // 7m invert color
+void EditorDrawStatusBar(){
+    int y = E.terminalRows;
 
-    char status[80], rStatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", E.filename ? E.filename : "[No Name]", E.numRows, E.dirty ? "(modified)" : "");
+    char status[80], rStatus[80], bufs[32] = "";
+    if(E.numBuffers > 1) snprintf(bufs, sizeof(bufs), "[%d/%d] ", EditorBufferIndex() + 1, E.numBuffers);
 
-    int rLen = snprintf(rStatus, sizeof(rStatus), "%s | %d/%d", E.syntax ? E.syntax->filetype : "no filetype", E.curY + 1, E.numRows);
+    const char* state = E.buf->follow.piped ? "(reading)" : E.buf->follow.fd != -1 ? "(following)" : E.buf->dirty ? "(modified)" : "";
+    int len = snprintf(status, sizeof(status), "%s%.20s - %d lines %s", bufs, E.buf->filename ? E.buf->filename : "[No Name]", E.buf->numRows, state);
+
+    int rLen = snprintf(rStatus, sizeof(rStatus), "%s | %d/%d", E.buf->syntax ? E.buf->syntax->filetype : "no filetype", E.buf->curY + 1, E.buf->numRows);
 
     if(len > E.terminalCols) len = E.terminalCols;
-    abAppend(ab, status, len);
 
-    while(len < E.terminalCols){
-        if(E.terminalCols - len == rLen){
-            abAppend(ab, rStatus, rLen);
-            break;
-        }
-        else {
-            abAppend(ab, " ", 1);
-            len++;
-        }
-    }
+    for(int x = 0; x < E.terminalCols; ++x) ScreenPut(y, x, ' ', CELL_INVERSE); // Whole bar in inverted color
+    ScreenPutString(y, 0, status, len, CELL_INVERSE);
 
-    abAppend(ab, "\x1b[m", 3); // m reset color
-    abAppend(ab, "\r\n", 2);
+    if(len + rLen <= E.terminalCols){
+        ScreenPutString(y, E.terminalCols - rLen, rStatus, rLen, CELL_INVERSE);
+    }
 }
 
-void EditorDrawMessageBar(struct abuf* ab){
-    abAppend(ab, "\x1b[K", 3);
-
+void EditorDrawMessageBar(){
     int msgLen = strlen(E.statusMsg);
 
     if(msgLen > E.terminalCols) msgLen = E.terminalCols;
     if(msgLen && time(NULL) - E.statusMsgTime < 5){
-        abAppend(ab, E.statusMsg, msgLen);
+        ScreenPutString(E.terminalRows + 1, 0, E.statusMsg, msgLen, HL_NORMAL);
     }
 }
 
 void EditorRefreshScreen(){
     EditorScroll();
 
-    struct abuf ab = ABUF_INIT;
-
-    abAppend(&ab, "\x1b[?25l", 6); // Hide cursor
-    abAppend(&ab, "\x1b[H", 3);
+    ScreenClear();
+    EditorDrawRows();
+    EditorDrawStatusBar();
+    EditorDrawMessageBar();
 
-    EditorDrawRows(&ab);
-    EditorDrawStatusBar(&ab);
-    EditorDrawMessageBar(&ab);
+    int curY = E.buf->curY - E.buf->rowOff;
+    int curX = E.buf->rndrX - E.buf->colOff;
+    if(renderer.running){
+        EditorRenderSubmit(curY, curX);
+        return;
+    }
 
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.curY - E.rowOff) + 1, (E.rndrX - E.colOff) + 1);
-    abAppend(&ab, buf, strlen(buf));
+    static struct abuf ab = ABUF_INIT; // Reused so a frame does not allocate once it has grown
+    ab.len = 0;
 
-    abAppend(&ab, "\x1b[?25h", 6); // Show cursor
+    ScreenFlush(&ab, E.back, E.buf, E.buf->rowOff, curY, curX);
 
-    write(STDOUT_FILENO, ab.buf, ab.len);
-    abFree(&ab);
+    if(ab.len) E.term->write(ab.buf, ab.len);
 }
 
 void EditorSetStatusMessage(const char* fmt, ...){
@@ -944,7 +5137,8 @@ char* EditorPrompt(char* prompt, void(*callback)(char*, int)){
 
     while(1){
         EditorSetStatusMessage(prompt, buf);
-        EditorRefreshScreen();
+        if(EditorInputPending()) EditorScroll(); // Keys still expect the view of the one before
+        else EditorRefreshScreen();
 
         int c = EditorReadKey();
         if(c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE){
@@ -963,7 +5157,7 @@ char* EditorPrompt(char* prompt, void(*callback)(char*, int)){
                 return buf;
             }
         }
-        else if (!iscntrl(c) && c < 128){
+        else if ((!iscntrl(c) && c < 128) || (c >= 128 && c < 256)){ // Including UTF-8
             if(bufLen == bufSize - 1){
                 bufSize *= 2;
                 buf = realloc(buf, bufSize);
@@ -978,46 +5172,109 @@ char* EditorPrompt(char* prompt, void(*callback)(char*, int)){
 }
 
 void EditorMoveCursor(int key){
-    eRow* row = (E.curY >= E.numRows) ? NULL : &E.row[E.curY];
+    int rowLen = (E.buf->curY >= E.buf->numRows) ? -1 : EditorRowSize(E.buf->curY);
 
     switch(key){
     case ARROW_LEFT:
-        if(E.curX != 0){
-            E.curX--;
-        } else if(E.curY > 0){
-            E.curY--;
-            E.curX = E.row[E.curY].size;
+        if(E.buf->curX != 0){
+            E.buf->curX = Utf8CharStart(EditorRowText(E.buf->curY), rowLen, E.buf->curX - 1);
+        } else if(E.buf->curY > 0){
+            E.buf->curY--;
+            E.buf->curX = EditorRowSize(E.buf->curY);
         }
         break;
     case ARROW_RIGHT:
-        if(row && E.curX < row->size){
-            E.curX++;
-        } else if(row && E.curX == row->size){
-            E.curY++;
-            E.curX = 0;
+        if(rowLen >= 0 && E.buf->curX < rowLen){
+            int width;
+            E.buf->curX += Utf8Char(EditorRowText(E.buf->curY) + E.buf->curX, rowLen - E.buf->curX, &width);
+        } else if(rowLen >= 0 && E.buf->curX == rowLen){
+            E.buf->curY++;
+            E.buf->curX = 0;
         }
         break;
     case ARROW_UP:
-        if(E.curY != 0){
-            E.curY--;
+        if(E.buf->curY != 0){
+            E.buf->curY--;
         }
         break;
     case ARROW_DOWN:
-        if(E.curY < E.numRows){
-            E.curY++;
+        if(E.buf->curY < E.buf->numRows){
+            E.buf->curY++;
         }
         break;
     }
 
-    row = (E.curY >= E.numRows) ? NULL : &E.row[E.curY];
-    int rowLen = row ? row->size : 0;
-    if(E.curX > rowLen){
-        E.curX = rowLen;
+    rowLen = (E.buf->curY >= E.buf->numRows) ? 0 : EditorRowSize(E.buf->curY);
+    if(E.buf->curX > rowLen){
+        E.buf->curX = rowLen;
+    }
+
+    if(E.buf->curX < rowLen){ // Onto the start of a character that another row's column cut into
+        E.buf->curX = Utf8CharStart(EditorRowText(E.buf->curY), rowLen, E.buf->curX);
+    }
+}
+
+// Takes everything up to PASTE_END as text and inserts it as one edit
+void EditorPaste(){
+    static const char end[] = "\x1b[201~";
+    struct abuf text = ABUF_INIT;
+
+    while(1){
+        char* p = E.input + E.inputPos;
+        int avail = E.inputLen - E.inputPos;
+
+        char* found = memmem(p, avail, end, 6);
+        if(found){
+            abAppend(&text, p, found - p);
+            E.inputPos += found - p + 6;
+            break;
+        }
+
+        int keep = 5; // The end marker may be split across reads
+        while(keep > 0 && (avail < keep || memcmp(p + avail - keep, end, keep))) keep--;
+
+        abAppend(&text, p, avail - keep);
+        E.inputPos += avail - keep;
+
+        if(!EditorWaitInput(JEDITOR_PASTE_WAIT)){ // The terminal never ended it
+            abAppend(&text, E.input + E.inputPos, E.inputLen - E.inputPos);
+            E.inputPos = E.inputLen;
+            break;
+        }
+    }
+
+    // Terminals send line ends as \r, rows are split on \n
+    int len = 0;
+    for(int j = 0; j < text.len; ++j){
+        if(text.buf[j] == '\r'){
+            text.buf[len++] = '\n';
+            if(j + 1 < text.len && text.buf[j + 1] == '\n') j++;
+        }
+        else text.buf[len++] = text.buf[j];
+    }
+    text.len = len;
+
+    if(len && E.buf->curY == E.buf->numRows){ // Pasting on ~ starts a new last row
+        if(E.buf->numRows == 0){
+            if(EditorEdit(EDIT_INSERT_ROW, 0, 0, NULL, 0) == -1) len = 0;
+            E.buf->curY = 0;
+        }
+        else {
+            abAppend(&text, "", 1);
+            memmove(text.buf + 1, text.buf, len++);
+            text.buf[0] = '\n';
+            E.buf->curY = E.buf->numRows - 1;
+            E.buf->curX = EditorRowSize(E.buf->curY);
+        }
     }
+
+    if(len) EditorEdit(EDIT_INSERT_TEXT, E.buf->curY, E.buf->curX, text.buf, len);
+    abFree(&text);
 }
 
 void EditorProcessKeypress(){
     static int quitTimes = JEDITOR_QUIT_TIMES;
+    static int closeTimes = JEDITOR_QUIT_TIMES;
 
     int c = EditorReadKey();
 
@@ -1026,28 +5283,64 @@ void EditorProcessKeypress(){
         EditorInsertNewline();
         break;
     case CTRL_KEY('q'):
-        if(E.dirty && quitTimes > 0){
+        EditorSaveReap(1); // A save that fails marks its buffer dirty again
+        if(EditorAnyDirty() && quitTimes > 0){
             EditorSetStatusMessage("WARNING: Unsaved Changes. Press Ctrl-Q %d times to force quit", quitTimes);
             quitTimes--;
             return;
         }
 
-        write(STDOUT_FILENO, "\x1b[2J", 4);
-        write(STDOUT_FILENO, "\x1b[H", 3);
+        for(int b = 0; b < E.numBuffers; ++b){ // Quitting throws the unsaved edits away
+            JournalClose(&E.buffers[b]->journal);
+        }
+
+        EditorRenderStop();
+        E.term->write("\x1b[2J\x1b[H", 7);
         exit(0);
         break;
+    case CTRL_KEY('w'):
+        EditorSaveReap(1); // A save that fails marks its buffer dirty again
+        if(E.buf->dirty && closeTimes > 0){
+            EditorSetStatusMessage("WARNING: Unsaved Changes. Press Ctrl-W %d times to close anyway", closeTimes);
+            closeTimes--;
+            return;
+        }
+
+        EditorCloseBuffer();
+        break;
     case CTRL_KEY('s'):
         EditorSave();
         break;
+    case CTRL_KEY('o'):
+        EditorOpenPrompt();
+        break;
+    case CTRL_KEY('n'):
+        EditorCycleBuffer(1);
+        break;
+    case CTRL_KEY('p'):
+        EditorCycleBuffer(-1);
+        break;
     case HOME_KEY:
-        E.curX = 0;
+        E.buf->curX = 0;
         break;
     case END_KEY:
-        if(E.curY < E.numRows)
-            E.curX = E.row[E.curY].size;
+        if(E.buf->curY < E.buf->numRows)
+            E.buf->curX = EditorRowSize(E.buf->curY);
         break;
     case CTRL_KEY('f'):
-        EditorFind();
+        EditorFind(0);
+        break;
+    case CTRL_KEY('r'):
+        EditorFind(1);
+        break;
+    case CTRL_KEY('g'):
+        EditorShowMemory();
+        break;
+    case CTRL_KEY('z'):
+        EditorUndo();
+        break;
+    case CTRL_KEY('y'):
+        EditorRedo();
         break;
     case BACKSPACE:
     case CTRL_KEY('h'):
@@ -1059,10 +5352,10 @@ void EditorProcessKeypress(){
     case PAGE_DOWN:
         {
             if(c == PAGE_UP){
-                E.curY = E.rowOff;
+                E.buf->curY = E.buf->rowOff;
             } else if (c == PAGE_DOWN){
-                E.curY = E.rowOff + E.terminalRows - 1;
-                if(E.curY > E.numRows) E.curY = E.numRows;
+                E.buf->curY = E.buf->rowOff + E.terminalRows - 1;
+                if(E.buf->curY > E.buf->numRows) E.buf->curY = E.buf->numRows;
             }
 
             int times = E.terminalRows;
@@ -1078,6 +5371,12 @@ void EditorProcessKeypress(){
         EditorMoveCursor(c);
         break;
     case CTRL_KEY('l'):
+        ScreenInvalidate(); // Repaint everything
+        break;
+    case PASTE_START:
+        EditorPaste();
+        break;
+    case PASTE_END:
     case '\x1b':
         break;
     default:
@@ -1086,45 +5385,521 @@ void EditorProcessKeypress(){
     }
 
     quitTimes = JEDITOR_QUIT_TIMES;
+    closeTimes = JEDITOR_QUIT_TIMES;
 }
 
 /*==== INIT ====*/
 
 void InitEditor(){
-    E.curX    = 0;
-    E.curY    = 0;
-    E.rndrX   = 0;
-    E.rowOff  = 0;
-    E.colOff  = 0;
-    E.numRows = 0;
-    E.dirty   = 0;
-    E.row      = NULL;
-    E.filename = NULL;
+    if(!setlocale(LC_CTYPE, "") || MB_CUR_MAX == 1) setlocale(LC_CTYPE, "C.UTF-8"); // For wcwidth
+
+    E.buf = NULL;
+    E.buffers = NULL;
+    E.numBuffers = 0;
+    E.inotifyFd = -1;
+    E.inputLen = E.inputPos = 0;
+    if(pipe2(E.wakeFd, O_NONBLOCK | O_CLOEXEC) == -1) Die("pipe2");
     E.statusMsg[0] = '\0';
     E.statusMsgTime = 0;
-    E.syntax = NULL;
 
-    if(GetTerminalSize(&E.terminalRows, &E.terminalCols) == -1){
-        Die("GetTerminalSize");
+    if(E.term->getSize(&E.terminalRows, &E.terminalCols) == -1){
+        Die("getSize");
     }
 
     E.terminalRows -= 2;
+
+    ScreenInit();
+    EditorCompileSyntaxDB();
+    EditorNewBuffer();
 }
 
+#ifndef JEDITOR_BENCH
 int main(int argc, char* argv[]){
+    int files = 0, dash = 0;
+    const char* record = NULL;
+    for(int j = 1; j < argc; ++j){
+        if(!strcmp(argv[j], "-n")) j++;
+        else if(!strcmp(argv[j], "-r")) record = argv[++j];
+        else if(!strcmp(argv[j], "-")) dash = 1;
+        else if(strcmp(argv[j], "-f")) files++;
+    }
+
+    // "-" or data piped in with no files named reads stdin, so keys have to come from the terminal itself
+    int fromStdin = dash || (files == 0 && !isatty(STDIN_FILENO));
+
+    E.term = &ttyTerminal;
+    E.ttyFd = STDIN_FILENO;
+    if(fromStdin){
+        E.ttyFd = open("/dev/tty", O_RDWR | O_CLOEXEC);
+        if(E.ttyFd == -1) Die("open /dev/tty");
+    }
+
+    E.recordFd = -1;
+    if(record){ // Every key typed, for replaying with the bench build
+        E.recordFd = open(record, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(E.recordFd == -1) Die("open record");
+    }
+
     EnableRawMode();
     InitEditor();
 
-    if(argc >= 2){
-        EditorOpen(argv[1]);
+    EditorSetStatusMessage("HELP: Ctrl-S: SAVE | Ctrl-Q: QUIT | CTRL-F: FIND | CTRL-R: REGEX | CTRL-Z/Y: UNDO");
+
+    int follow = 0, maxRows = 0, opened = 0;
+
+    for(int j = 1; j < argc; ++j){ // One buffer per file, -f follows the files after it
+        if(!strcmp(argv[j], "-f")){
+            follow = 1;
+            continue;
+        }
+        if(!strcmp(argv[j], "-n") && j + 1 < argc){ // Rows kept of a followed file
+            maxRows = atoi(argv[++j]);
+            continue;
+        }
+        if(!strcmp(argv[j], "-r")){ // Opened above
+            j++;
+            continue;
+        }
+
+        if(opened++) EditorNewBuffer();
+        if(!strcmp(argv[j], "-")){
+            EditorPipeOpen(maxRows);
+            continue;
+        }
+
+        if(EditorOpen(argv[j]) == -1) Die("open");
+        if(follow) EditorFollow(maxRows);
     }
+    if(fromStdin && !dash) EditorPipeOpen(maxRows);
+    if(E.numBuffers > 1) EditorSwitchBuffer(0);
 
-    EditorSetStatusMessage("HELP: Ctrl-S: SAVE | Ctrl-Q: QUIT | CTRL-F: FIND");
+    EditorRenderStart();
 
     while(1){
         EditorRefreshScreen();
         EditorProcessKeypress();
+        while(EditorInputPending()){ // Everything already read, then one redraw
+            EditorScroll();
+            EditorProcessKeypress();
+        }
+    }
+
+    return 0;
+}
+#endif
+
+/*==== BENCH ====*/
+
+// Built by `make bench`: runs the editor on memoryTerminal against a generated
+// file and reports the time and heap traffic of each workload, or replays keys
+// recorded with -r and reports the cost of every keystroke. malloc and friends
+// are wrapped by the linker (--wrap) to count allocations.
+
+#ifdef JEDITOR_BENCH
+
+#define BENCH_ROWS 40
+#define BENCH_COLS 120
+
+struct benchCounters {
+    size_t allocs;
+    size_t frees;
+    size_t bytes;
+};
+
+struct benchCounters bench;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void __real_free(void* ptr);
+
+void* __wrap_malloc(size_t size){
+    __atomic_add_fetch(&bench.allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bench.bytes, size, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size){
+    __atomic_add_fetch(&bench.allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bench.bytes, count * size, __ATOMIC_RELAXED);
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size){
+    __atomic_add_fetch(&bench.allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bench.bytes, size, __ATOMIC_RELAXED);
+    return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void* ptr){
+    if(ptr) __atomic_add_fetch(&bench.frees, 1, __ATOMIC_RELAXED);
+    __real_free(ptr);
+}
+
+double BenchNow(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+struct benchRun {
+    const char* name;
+    double start;
+    struct benchCounters before;
+    size_t written;
+};
+
+void BenchBegin(struct benchRun* run, const char* name){
+    run->name = name;
+    run->before = bench;
+    run->written = memTerm.written;
+    run->start = BenchNow();
+}
+
+void BenchEnd(struct benchRun* run, int ops){
+    double ms = BenchNow() - run->start;
+    struct benchCounters after = bench;
+
+    printf("%-14s %8d %12.2f %12.2f %10zu %10zu %14zu",
+           run->name, ops, ms, ms * 1e3 / ops,
+           (after.allocs - run->before.allocs) / ops, (after.frees - run->before.frees) / ops,
+           (after.bytes - run->before.bytes) / ops);
+    if(memTerm.written != run->written) printf(" %12zu", (memTerm.written - run->written) / ops);
+    printf("\n");
+}
+
+void BenchWriteFile(const char* path, int lines){
+    FILE* fp = fopen(path, "w");
+    if(fp == NULL) Die("fopen");
+
+    for(int i = 0; i < lines; ++i){
+        if(i % 7 == 0) fprintf(fp, "/* block %d: generated for the bench */\n", i);
+        else fprintf(fp, "\tint value%d = compute(%d, \"row\"); // line %d\n", i, i * 31, i);
+    }
+
+    if(fclose(fp) == EOF) Die("fclose");
+}
+
+void BenchOpen(const char* path, int iters){
+    struct benchRun run;
+    double total = 0;
+    struct benchCounters before = bench;
+    size_t written = memTerm.written;
+
+    for(int i = 0; i < iters; ++i){
+        EditorNewBuffer();
+
+        double start = BenchNow();
+        if(EditorOpen((char*)path) == -1) Die("open");
+        total += BenchNow() - start;
+
+        EditorCloseBuffer();
+    }
+
+    run.name = "open";
+    run.before = before;
+    run.written = written;
+    run.start = BenchNow() - total; // Only the EditorOpen calls are timed
+    BenchEnd(&run, iters);
+}
+
+#define BENCH_APPEND(ab, s) abAppend(ab, s, sizeof(s) - 1)
+
+void BenchRunKeys(const char* name, struct abuf* script){
+    MemTermFeed(script->buf, script->len);
+
+    struct benchRun run;
+    int keys = 0;
+
+    BenchBegin(&run, name);
+    while(MemTermPending() || EditorInputPending()){
+        EditorProcessKeypress();
+        EditorScroll();
+        keys++;
+    }
+    BenchEnd(&run, keys);
+}
+
+void BenchKeys(int iters){
+    struct abuf script = ABUF_INIT;
+    for(int i = 0; i < iters; ++i){
+        BENCH_APPEND(&script, "\tint typed = compute(42); // benchmark\r");
+        BENCH_APPEND(&script, "\x1b[B\x1b[B\x1b[F"); // Down twice, end of line
+        BENCH_APPEND(&script, "\x7f\x7f\x7f\x7f"); // Backspace
+        BENCH_APPEND(&script, "\x1b[A\x1b[H\x1b[3~"); // Up, home, delete
+        if(i % 10 == 9) BENCH_APPEND(&script, "\x1a\x1a\x19"); // Undo twice, redo
+        if(i % 25 == 24) BENCH_APPEND(&script, "\x1b[6~"); // Page down
+    }
+
+    BenchRunKeys("keys", &script);
+    abFree(&script);
+}
+
+// Cursor moves and typing on a 1MB row of UTF-8 and tabs, where every key
+// needs the column of the cursor and every edit highlights the row again
+void BenchLongRow(int iters){
+    struct abuf text = ABUF_INIT;
+    while(text.len < (1 << 20)) BENCH_APPEND(&text, "\tname = \"naïve café 日本語\", ");
+
+    EditorInsertRow(0, text.buf, text.len);
+    E.buf->curY = E.buf->curX = 0;
+    abFree(&text);
+
+    struct abuf script = ABUF_INIT;
+    for(int i = 0; i < iters; ++i){
+        BENCH_APPEND(&script, "\x1b[F\x1b[D\x1b[D\x1b[D\x1b[D\x1b[C\x1b[C"); // End, left, right
+        if(i % 10 == 9) BENCH_APPEND(&script, "\x1b[H\x1b[C\x1b[C"); // Home, right
+    }
+
+    BenchRunKeys("long row keys", &script);
+
+    script.len = 0;
+    for(int i = 0; i < iters; ++i){
+        BENCH_APPEND(&script, "\x1b[Fab\x7f"); // Typing at the end
+        if(i % 10 == 9) BENCH_APPEND(&script, "\x1b[Hx\x7f"); // And at the start
+    }
+
+    BenchRunKeys("long row typing", &script);
+    abFree(&script);
+}
+
+void BenchRender(int frames){
+    struct benchRun run;
+
+    E.buf->curY = 0;
+    E.buf->curX = 0;
+
+    BenchBegin(&run, "render scroll");
+    for(int i = 0; i < frames; ++i){
+        E.buf->curY = (E.buf->curY + E.terminalRows / 2) % E.buf->numRows;
+        EditorRefreshScreen();
+    }
+    BenchEnd(&run, frames);
+
+    BenchBegin(&run, "render full");
+    for(int i = 0; i < frames; ++i){
+        E.screenValid = 0;
+        EditorRefreshScreen();
+    }
+    BenchEnd(&run, frames);
+
+    BenchBegin(&run, "render idle");
+    for(int i = 0; i < frames; ++i){
+        EditorRefreshScreen();
+    }
+    BenchEnd(&run, frames);
+}
+
+void BenchFind(const char* name, int regex, const char* query, int iters){
+    char keys[128];
+    snprintf(keys, sizeof(keys), "%s\x1b[B\x1b[B\x1b[B\r", query); // Type it, step to the third match, accept
+
+    struct benchRun run;
+    BenchBegin(&run, name);
+    for(int i = 0; i < iters; ++i){
+        MemTermFeed(keys, strlen(keys));
+        EditorFind(regex);
+    }
+    BenchEnd(&run, iters);
+}
+
+void BenchSave(int iters){
+    struct benchRun run;
+
+    BenchBegin(&run, "save");
+    for(int i = 0; i < iters; ++i){
+        EditorSave();
+        EditorSaveReap(1);
+    }
+    BenchEnd(&run, iters);
+}
+
+// Pastes, undoes the paste and types over a small file, drops the buffer as
+// a crash would, with its journal left behind, and opens the file again
+void BenchRecover(const char* path, int iters){
+    const char* want[] = {"Xhello", "world"};
+    struct benchRun run;
+    double total = 0;
+    struct benchCounters before = bench;
+    size_t written = memTerm.written;
+
+    for(int i = 0; i < iters; ++i){
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd == -1 || WriteAll(fd, "hello\nworld\n", 12) == -1) Die(path);
+        close(fd);
+
+        EditorNewBuffer();
+        if(EditorOpen((char*)path) == -1) Die("open");
+
+        const char keys[] = "\x1b[200~abc\rdef\rghi\x1b[201~\x1aX"; // Paste, undo, type
+        MemTermFeed(keys, sizeof(keys) - 1);
+        while(MemTermPending() || EditorInputPending()) EditorProcessKeypress();
+
+        struct journal* j = &E.buf->journal;
+        JournalCommit(j, 1);
+        close(j->fd);
+        j->fd = -1; // So closing the buffer leaves the journal
+        EditorCloseBuffer();
+
+        EditorNewBuffer();
+        double start = BenchNow();
+        if(EditorOpen((char*)path) == -1) Die("open");
+        total += BenchNow() - start;
+
+        if(E.buf->numRows != 2) Die("recover");
+        for(int r = 0; r < 2; ++r){
+            eRow* row = EditorRowMaterialize(r);
+            if(EditorRowSize(r) != (int)strlen(want[r]) || memcmp(row->chars, want[r], EditorRowSize(r))) Die("recover");
+        }
+
+        EditorCloseBuffer();
+    }
+
+    unlink(path);
+
+    run.name = "recover";
+    run.before = before;
+    run.written = written;
+    run.start = BenchNow() - total; // Only the reopening EditorOpen calls are timed
+    BenchEnd(&run, iters);
+}
+
+int BenchCompareTimes(const void* a, const void* b){
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+char* BenchReadFile(const char* path, size_t* len){
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if(fd == -1 || fstat(fd, &st) == -1) Die(path);
+
+    char* data = malloc(st.st_size + 1);
+    if(data == NULL) Die("malloc");
+
+    ssize_t n = read(fd, data, st.st_size);
+    if(n != st.st_size) Die(path);
+
+    close(fd);
+    *len = n;
+    return data;
+}
+
+// Replays keys recorded with -r, a frame after every key like the real loop,
+// on a copy of the file so a recorded save does not touch the original
+void BenchReplay(const char* keysPath, const char* file, const char* copy){
+    size_t keysLen;
+    char* keys = BenchReadFile(keysPath, &keysLen);
+
+    if(file){
+        size_t len;
+        char* data = BenchReadFile(file, &len);
+        int fd = open(copy, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd == -1 || WriteAll(fd, data, len) == -1) Die(copy);
+        close(fd);
+        free(data);
+
+        if(EditorOpen((char*)copy) == -1) Die("open");
+    }
+
+    char* quit = memchr(keys, CTRL_KEY('q'), keysLen); // Quitting would end the bench too
+    MemTermFeed(keys, quit ? (size_t)(quit - keys) : keysLen);
+    EditorRefreshScreen();
+
+    int count = 0, cap = 1024;
+    double* times = malloc(sizeof(*times) * cap);
+    if(times == NULL) Die("malloc");
+
+    struct benchRun run;
+    BenchBegin(&run, "replay");
+    while(MemTermPending() || EditorInputPending()){
+        double start = BenchNow();
+        EditorProcessKeypress();
+        EditorRefreshScreen();
+
+        if(count == cap){
+            times = realloc(times, sizeof(*times) * (cap *= 2));
+            if(times == NULL) Die("realloc");
+        }
+        times[count++] = BenchNow() - start;
+    }
+    if(count == 0) Die("no keys to replay");
+    BenchEnd(&run, count);
+
+    qsort(times, count, sizeof(*times), BenchCompareTimes);
+    printf("\nper key us: median %.2f, p90 %.2f, p99 %.2f, max %.2f\n",
+           times[count / 2] * 1e3, times[count * 9 / 10] * 1e3, times[count * 99 / 100] * 1e3, times[count - 1] * 1e3);
+
+    free(times);
+    free(keys);
+}
+
+void BenchWorkloads(const char* path, int iters){
+    BenchOpen(path, iters);
+
+    if(EditorOpen((char*)path) == -1) Die("open");
+    BenchRender(iters * 100);
+    BenchKeys(iters * 100);
+    BenchFind("find literal", 0, "compute(4242", iters);
+    BenchFind("find missing", 0, "no such text", iters);
+    BenchFind("find regex", 1, "value[0-9]+7 =", iters);
+    BenchSave(iters);
+
+    char recover[512];
+    snprintf(recover, sizeof(recover), "%s.recover.c", path);
+    BenchRecover(recover, iters);
+
+    BenchLongRow(iters * 100);
+}
+
+void BenchHeader(){
+    printf("%-14s %8s %12s %12s %10s %10s %14s %12s\n", "workload", "ops", "total ms", "us/op", "allocs/op", "frees/op", "bytes/op", "out/op");
+}
+
+void BenchUsage(const char* name){
+    fprintf(stderr, "usage: %s [lines] [iterations]\n       %s -r keys [file]\n", name, name);
+    exit(1);
+}
+
+int main(int argc, char* argv[]){
+    int replay = argc > 1 && !strcmp(argv[1], "-r");
+    if(replay && argc < 3) BenchUsage(argv[0]);
+
+    int lines = !replay && argc > 1 ? atoi(argv[1]) : 1000000;
+    int iters = !replay && argc > 2 ? atoi(argv[2]) : 10;
+    if(lines <= 0 || iters <= 0) BenchUsage(argv[0]);
+
+    char dir[] = "/tmp/jeditor-bench-XXXXXX";
+    if(mkdtemp(dir) == NULL) Die("mkdtemp");
+
+    char path[512];
+    E.term = &memoryTerminal;
+    E.recordFd = -1;
+    memTerm.rows = BENCH_ROWS + 2;
+    memTerm.cols = BENCH_COLS;
+    InitEditor();
+
+    if(replay){ // Named after the original so the syntax matches
+        const char* base = argc > 3 ? strrchr(argv[3], '/') : NULL;
+        snprintf(path, sizeof(path), "%s/%s", dir, base ? base + 1 : argc > 3 ? argv[3] : "none");
+
+        BenchHeader();
+        BenchReplay(argv[2], argc > 3 ? argv[3] : NULL, path);
+    }
+    else {
+        snprintf(path, sizeof(path), "%s/bench.c", dir);
+        BenchWriteFile(path, lines);
+
+        printf("%d lines, %d iterations, %dx%d screen\n\n", lines, iters, BENCH_COLS, BENCH_ROWS);
+        BenchHeader();
+        BenchWorkloads(path, iters);
     }
 
+    EditorCloseBuffer();
+    unlink(path);
+    rmdir(dir);
+
     return 0;
-}
\ No newline at end of file
+}
+
+#endif